@@ -0,0 +1,54 @@
+#!/bin/sh
+# Compares the readline build of the shell with the built-in line editor
+# build (-DUSE_LINEEDIT): startup time over a number of runs and peak RSS of
+# an idle shell waiting for input. The shells read from a pipe, so neither
+# builds the completion index and only the line editors are compared. Results from
+# one machine are in bench/lineedit-report.txt.
+#
+# Usage: bench/lineedit.sh [runs]
+
+set -e
+
+RUNS=${1:-200}
+SRC=$(cd "$(dirname "$0")/.." && pwd)
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+
+$CC $CFLAGS -pthread -o "$TMP/shell-readline" "$SRC/main.c" "$SRC/parser.c" "$SRC/lineedit.c" -lreadline
+$CC $CFLAGS -pthread -DUSE_LINEEDIT -o "$TMP/shell-lineedit" "$SRC/main.c" "$SRC/parser.c" "$SRC/lineedit.c"
+
+now_ns() {
+    date +%s%N
+}
+
+# Peak RSS in kB of a shell waiting for input
+peak_rss() {
+    mkfifo "$TMP/in"
+    "$1" < "$TMP/in" > /dev/null &
+    pid=$!
+    exec 3> "$TMP/in"
+    sleep 0.3
+    rss=$(awk '/VmHWM/ { print $2 }' "/proc/$pid/status")
+    echo exit >&3
+    exec 3>&-
+    wait $pid || true
+    rm -f "$TMP/in"
+    echo "$rss"
+}
+
+printf '%-10s %14s %12s %12s\n' build "startup (us)" "peak RSS kB" "binary kB"
+for build in readline lineedit; do
+    bin="$TMP/shell-$build"
+    start=$(now_ns)
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        echo exit | "$bin" > /dev/null
+        i=$((i + 1))
+    done
+    end=$(now_ns)
+    size=$(( $(wc -c < "$bin") / 1024 ))
+    printf '%-10s %14d %12s %12d\n' "$build" $(( (end - start) / RUNS / 1000 )) "$(peak_rss "$bin")" "$size"
+done
@@ -0,0 +1,63 @@
+#!/bin/sh
+# Times bench/workload.sh, section by section, with the plain (-O2), LTO and
+# PGO+LTO builds from the Makefile. Each build is made from a clean copy of
+# the sources; each figure is the best wall time of a number of runs. The
+# parse and expand sections are run for ten times as many rounds as the rest.
+#
+# Usage: bench/pgo-report.sh [runs] [rounds]
+
+set -e
+
+RUNS=${1:-25}
+ROUNDS=${2:-3}
+SRC=$(cd "$(dirname "$0")/.." && pwd)
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+for build in plain lto pgo; do
+    mkdir "$TMP/$build"
+    cp "$SRC"/Makefile "$SRC"/*.c "$SRC"/*.h "$TMP/$build"
+    cp -r "$SRC/bench" "$TMP/$build"
+    target=$build
+    [ "$build" = plain ] && target=shell
+    make -s -C "$TMP/$build" clean-objs "$target" > /dev/null
+done
+
+now_ns() {
+    date +%s%N
+}
+
+# Runs input $1 through each build in turn, RUNS times, so that any drift in
+# machine load affects all of them alike; prints the best wall time of each
+# build in microseconds
+best_us() {
+    best_plain= best_lto= best_pgo=
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        for build in plain lto pgo; do
+            start=$(now_ns)
+            SHELL_LINE_EDITOR=builtin "$TMP/$build/shell" < "$1" > /dev/null 2>&1
+            t=$(( ($(now_ns) - start) / 1000 ))
+            eval "best=\$best_$build"
+            if [ -z "$best" ] || [ "$t" -lt "$best" ]; then
+                eval "best_$build=$t"
+            fi
+        done
+        i=$((i + 1))
+    done
+    echo "$best_plain $best_lto $best_pgo"
+}
+
+echo "$(${CC:-cc} --version | head -n 1), best of $RUNS runs"
+printf '%-10s %8s %12s %12s %12s %10s\n' section rounds "plain (us)" "lto (us)" "pgo (us)" "pgo/plain"
+for section in parse expand glob pipeline all; do
+    # The sections that do not fork are short, so run them for longer
+    rounds=$ROUNDS
+    case $section in
+        parse|expand) rounds=$((ROUNDS * 10)) ;;
+    esac
+    sh "$SRC/bench/workload.sh" $section $rounds > "$TMP/$section.in"
+    set -- $(best_us "$TMP/$section.in")
+    printf '%-10s %8d %12d %12d %12d %10s\n' $section $rounds "$1" "$2" "$3" \
+        "$(awk -v a="$3" -v b="$1" 'BEGIN { printf("%.3f", a / b) }')"
+done
@@ -0,0 +1,374 @@
+/*
+ * replay.c
+ * Load-testing driver for session records written with SHELL_RECORD or
+ * 'set -o record'. Each record file is one session; the driver starts the
+ * shell under test, feeds it the recorded lines on the recorded schedule
+ * (optionally sped up, or as fast as possible) and runs several copies at
+ * once if asked. The shell under test records its own timings, which are then
+ * summarised as latency percentiles per command.
+ *
+ * Build : cc -O2 -o replay bench/replay.c
+ * Usage : replay [-s speed] [-c copies] shell record...
+ *         speed 1 replays at the original pace, 10 ten times faster and 0
+ *         without any pauses.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+struct record {
+    long long wall;      // start time in microseconds since the epoch
+    long long duration;  // microseconds
+    int status;
+    char *cwd;
+    char *line;          // still escaped, ready to be fed back
+};
+
+struct session {
+    struct record *records;
+    int count;
+};
+
+struct replay {
+    struct session *session;
+    pid_t pid;
+    int fd;
+    int next;            // next record to feed
+    char log[64];
+};
+
+struct sample {
+    char name[32];
+    long long *values;
+    int count;
+    int alloc;
+};
+
+// Function to read a record file; returns 0 on success
+static int read_session(const char *path, struct session *session) {
+    FILE *fp = fopen(path, "r");
+    char *buf = NULL;
+    size_t cap = 0;
+    ssize_t len;
+
+    if (fp == NULL) {
+        perror(path);
+        return -1;
+    }
+    session->records = NULL;
+    session->count = 0;
+
+    while ((len = getline(&buf, &cap, fp)) != -1) {
+        struct record rec;
+        char *fields[5];
+        char *p = buf;
+
+        if (buf[0] == '#') {
+            continue;
+        }
+        if (len > 0 && buf[len - 1] == '\n') {
+            buf[len - 1] = '\0';
+        }
+        for (int i = 0; i < 4; i++) {
+            fields[i] = strsep(&p, "\t");
+        }
+        fields[4] = p;
+        if (fields[4] == NULL) {
+            continue;
+        }
+        rec.wall = atoll(fields[0]);
+        rec.duration = atoll(fields[1]);
+        rec.status = atoi(fields[2]);
+        rec.cwd = strdup(fields[3]);
+        rec.line = strdup(fields[4]);
+
+        session->records = realloc(session->records, (session->count + 1) * sizeof(struct record));
+        session->records[session->count++] = rec;
+    }
+    free(buf);
+    fclose(fp);
+    return 0;
+}
+
+// Function to turn an escaped record line back into what was typed
+static size_t unescape(const char *in, char *out) {
+    size_t n = 0;
+
+    for (; *in != '\0'; in++) {
+        if (*in == '\\' && in[1] != '\0') {
+            in++;
+            out[n++] = *in == 't' ? '\t' : *in == 'n' ? '\n' : *in;
+        } else {
+            out[n++] = *in;
+        }
+    }
+    return n;
+}
+
+static long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void start_replay(struct replay *r, const char *shell, const char *dir, int index) {
+    int fds[2];
+
+    snprintf(r->log, sizeof(r->log), "%s/replay.%d.%d.log", dir, (int)getpid(), index);
+    unlink(r->log);
+    if (pipe(fds) == -1) {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+
+    r->pid = fork();
+    if (r->pid == -1) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    if (r->pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(fds[0], STDIN_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        close(null_fd);
+        // Start where the session started, if that directory exists here
+        if (r->session->count > 0 && r->session->records[0].cwd[0] != '\0') {
+            if (chdir(r->session->records[0].cwd) == -1) {
+                // Stay in the current directory
+            }
+        }
+        setenv("SHELL_RECORD", r->log, 1);
+        execl(shell, shell, (char *)NULL);
+        perror(shell);
+        exit(127);
+    }
+    close(fds[0]);
+    r->fd = fds[1];
+    r->next = 0;
+}
+
+static void add_sample(struct sample **samples, int *nsamples, const char *name, long long value) {
+    int i;
+
+    for (i = 0; i < *nsamples; i++) {
+        if (strcmp((*samples)[i].name, name) == 0) {
+            break;
+        }
+    }
+    if (i == *nsamples) {
+        *samples = realloc(*samples, (*nsamples + 1) * sizeof(struct sample));
+        memset(&(*samples)[i], 0, sizeof(struct sample));
+        snprintf((*samples)[i].name, sizeof((*samples)[i].name), "%s", name);
+        (*nsamples)++;
+    }
+    struct sample *s = &(*samples)[i];
+    if (s->count == s->alloc) {
+        s->alloc = s->alloc ? s->alloc * 2 : 16;
+        s->values = realloc(s->values, s->alloc * sizeof(long long));
+    }
+    s->values[s->count++] = value;
+}
+
+static int compare_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int compare_samples(const void *a, const void *b) {
+    return ((const struct sample *)b)->count - ((const struct sample *)a)->count;
+}
+
+static long long percentile(const struct sample *s, double p) {
+    int index = (int)(p * (s->count - 1) + 0.5);
+    return s->values[index];
+}
+
+static void print_sample(const struct sample *s) {
+    printf("%-24s %8d %10lld %10lld %10lld %10lld\n", s->name, s->count,
+           percentile(s, 0.5), percentile(s, 0.9), percentile(s, 0.99), s->values[s->count - 1]);
+}
+
+// Function to collect the durations in a record file, per command name
+static void collect(const char *path, struct sample **samples, int *nsamples, struct sample *all) {
+    struct session session;
+
+    if (read_session(path, &session) == -1) {
+        return;
+    }
+    for (int i = 0; i < session.count; i++) {
+        char name[32];
+        const char *line = session.records[i].line;
+        size_t len = strcspn(line + strspn(line, " "), " |;&<>");
+
+        snprintf(name, sizeof(name), "%.*s", (int)len, line + strspn(line, " "));
+        add_sample(samples, nsamples, name, session.records[i].duration);
+        if (all->count == all->alloc) {
+            all->alloc = all->alloc ? all->alloc * 2 : 64;
+            all->values = realloc(all->values, all->alloc * sizeof(long long));
+        }
+        all->values[all->count++] = session.records[i].duration;
+        free(session.records[i].cwd);
+        free(session.records[i].line);
+    }
+    free(session.records);
+}
+
+int main(int argc, char **argv) {
+    double speed = 1;
+    int copies = 1;
+    int opt;
+    const char *tmpdir = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+
+    while ((opt = getopt(argc, argv, "s:c:")) != -1) {
+        switch (opt) {
+            case 's': speed = atof(optarg); break;
+            case 'c': copies = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-s speed] [-c copies] shell record...\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (argc - optind < 2 || copies < 1 || speed < 0) {
+        fprintf(stderr, "usage: %s [-s speed] [-c copies] shell record...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const char *shell = argv[optind];
+    int nfiles = argc - optind - 1;
+    int nsessions = 0;
+    struct session sessions[nfiles];
+    for (int i = 0; i < nfiles; i++) {
+        const char *path = argv[optind + 1 + i];
+        if (read_session(path, &sessions[nsessions]) == -1) {
+            return EXIT_FAILURE;
+        }
+        // A record that holds only the header has nothing to replay
+        if (sessions[nsessions].count == 0) {
+            fprintf(stderr, "%s: no commands recorded, skipped\n", path);
+            free(sessions[nsessions].records);
+            continue;
+        }
+        nsessions++;
+    }
+    if (nsessions == 0) {
+        fprintf(stderr, "no sessions to replay\n");
+        return EXIT_FAILURE;
+    }
+
+    // A shell that exits early must not kill the driver
+    signal(SIGPIPE, SIG_IGN);
+
+    int nreplays = nsessions * copies;
+    struct replay replays[nreplays];
+    long long start = now_us();
+    for (int i = 0; i < nreplays; i++) {
+        replays[i].session = &sessions[i % nsessions];
+        start_replay(&replays[i], shell, tmpdir, i);
+    }
+
+    // Feed every replay its next line once it is due, earliest first
+    while (1) {
+        struct replay *due = NULL;
+        long long due_at = 0;
+
+        for (int i = 0; i < nreplays; i++) {
+            struct replay *r = &replays[i];
+            if (r->fd < 0) {
+                continue;
+            }
+            long long offset = r->session->records[r->next].wall - r->session->records[0].wall;
+            long long at = start + (speed > 0 ? (long long)(offset / speed) : 0);
+            if (due == NULL || at < due_at) {
+                due = r;
+                due_at = at;
+            }
+        }
+        if (due == NULL) {
+            break;
+        }
+
+        long long wait = due_at - now_us();
+        if (wait > 0) {
+            usleep(wait);
+        }
+
+        const char *line = due->session->records[due->next].line;
+        char *buf = malloc(strlen(line) + 2);
+        size_t len = unescape(line, buf);
+        buf[len++] = '\n';
+        if (write(due->fd, buf, len) != (ssize_t)len) {
+            // The shell has gone, stop feeding it
+            due->next = due->session->count - 1;
+        }
+        free(buf);
+
+        if (++due->next == due->session->count) {
+            close(due->fd);
+            due->fd = -1;
+        }
+    }
+
+    for (int i = 0; i < nreplays; i++) {
+        waitpid(replays[i].pid, NULL, 0);
+    }
+    long long elapsed = now_us() - start;
+
+    // Summarise what the shells under test recorded
+    struct sample *samples = NULL;
+    int nsamples = 0;
+    struct sample all;
+    struct sample recorded;
+    memset(&all, 0, sizeof(all));
+    memset(&recorded, 0, sizeof(recorded));
+    snprintf(all.name, sizeof(all.name), "(all, replayed)");
+    snprintf(recorded.name, sizeof(recorded.name), "(all, recorded)");
+
+    for (int i = 0; i < nreplays; i++) {
+        collect(replays[i].log, &samples, &nsamples, &all);
+        unlink(replays[i].log);
+    }
+    for (int i = 0; i < nsessions; i++) {
+        for (int j = 0; j < sessions[i].count; j++) {
+            if (recorded.count == recorded.alloc) {
+                recorded.alloc = recorded.alloc ? recorded.alloc * 2 : 64;
+                recorded.values = realloc(recorded.values, recorded.alloc * sizeof(long long));
+            }
+            recorded.values[recorded.count++] = sessions[i].records[j].duration;
+        }
+    }
+    if (all.count == 0) {
+        fprintf(stderr, "no commands were recorded by %s\n", shell);
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < nsamples; i++) {
+        qsort(samples[i].values, samples[i].count, sizeof(long long), compare_ll);
+    }
+    qsort(samples, nsamples, sizeof(struct sample), compare_samples);
+    qsort(all.values, all.count, sizeof(long long), compare_ll);
+    qsort(recorded.values, recorded.count, sizeof(long long), compare_ll);
+
+    printf("%d replays of %d sessions, %d commands in %.3f s\n\n", nreplays, nsessions, all.count, elapsed / 1e6);
+    printf("%-24s %8s %10s %10s %10s %10s\n", "command", "count", "p50 us", "p90 us", "p99 us", "max us");
+    for (int i = 0; i < nsamples; i++) {
+        print_sample(&samples[i]);
+    }
+    printf("\n");
+    print_sample(&all);
+    print_sample(&recorded);
+    return EXIT_SUCCESS;
+}
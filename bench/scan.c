@@ -0,0 +1,206 @@
+/*
+ * scan.c
+ * Benchmark for the parser's metacharacter scanning on generated command
+ * lines of several megabytes. It compares the library search calls the parser
+ * used to make (strpbrk for separators, strstr and index for redirections,
+ * strtok for arguments) with scan_build() and a walk over its bitmaps, for
+ * each classification kernel, and then times process_cmd_line() itself.
+ * The classify rows time scan_build() alone.
+ *
+ * Build : cc -O2 -I. -o scan bench/scan.c parser.c
+ * Usage : scan [megabytes...]        (default 1 4 16)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "parser.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define cycles() __rdtsc()
+#else
+#define cycles() 0ULL
+#endif
+
+#define ROUNDS 5
+
+static const char *words[] = {
+    "ls", "-l", "grep", "-v", "foo", "cat", "file.txt", "sort", "-n", "wc",
+    "--count", "awk", "'{print $1}'", "src/main.c", "x", "echo", "hello",
+};
+
+// Function to generate a line of roughly size bytes that looks like a long pipeline
+static char *generate(size_t size) {
+    char *line = malloc(size + 64);
+    size_t len = 0;
+    unsigned seed = 1;
+
+    while (len < size) {
+        seed = seed * 1103515245 + 12345;
+        unsigned r = seed >> 16;
+        const char *w = words[r % (sizeof(words) / sizeof(words[0]))];
+        memcpy(line + len, w, strlen(w));
+        len += strlen(w);
+        switch ((r >> 8) % 16) {
+            case 0: memcpy(line + len, " | ", 3); len += 3; break;
+            case 1: memcpy(line + len, " ; ", 3); len += 3; break;
+            case 2: memcpy(line + len, " > out ", 7); len += 7; break;
+            case 3: line[len++] = '\t'; break;
+            default: line[len++] = ' '; break;
+        }
+    }
+    line[len] = '\0';
+    return line;
+}
+
+// The searches the parser made before the scan, without its allocations
+static size_t scan_libc(char *line) {
+    size_t tokens = 0;
+    char *cmd = line;
+    char *next;
+
+    do {
+        next = strpbrk(cmd, "&|;");
+        if (next != NULL) {
+            *next++ = '\0';
+        }
+        if (strstr(cmd, "2>") == NULL && index(cmd, '<') == NULL && index(cmd, '>') == NULL) {
+            tokens++;
+        }
+        for (char *t = strtok(cmd, white_space); t != NULL; t = strtok(NULL, white_space)) {
+            tokens++;
+        }
+        cmd = next;
+    } while (cmd != NULL);
+    return tokens;
+}
+
+// The same walk over the bitmaps built in one sweep
+static size_t scan_bitmap(char *line) {
+    scan_index idx;
+    size_t len = strlen(line);
+    size_t tokens = 0;
+    size_t pos = 0;
+
+    scan_build(line, len, &idx);
+    while (pos < len) {
+        size_t end = scan_next(idx.sep, len, pos);
+        if (scan_next(idx.redir, end, pos) == end) {
+            tokens++;
+        }
+        for (size_t t = scan_next_clear(idx.space, end, pos); t < end;
+             t = scan_next_clear(idx.space, end, scan_next(idx.space, end, t))) {
+            tokens++;
+        }
+        pos = end + 1;
+    }
+    scan_free(&idx);
+    return tokens;
+}
+
+// Classification alone, returning the number of separators found
+static size_t scan_only(char *line) {
+    scan_index idx;
+    size_t len = strlen(line);
+    size_t seps = 0;
+
+    scan_build(line, len, &idx);
+    for (size_t w = 0; w < (len + 63) / 64; w++) {
+        seps += __builtin_popcountll(idx.sep[w]);
+    }
+    scan_free(&idx);
+    return seps;
+}
+
+static size_t parse_line(char *line) {
+    command **cmd_line = process_cmd_line(line, 1);
+    size_t n = 0;
+
+    while (cmd_line[n] != NULL) {
+        n++;
+    }
+    clean_up(cmd_line);
+    return n;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Function to time the best of ROUNDS runs on a fresh copy of the line
+static void measure(const char *label, size_t (*fn)(char *), const char *line, size_t len) {
+    char *copy = malloc(len + 1);
+    double best_s = 0;
+    unsigned long long best_c = 0;
+    size_t result = 0;
+
+    for (int i = 0; i < ROUNDS; i++) {
+        memcpy(copy, line, len + 1);
+        double t0 = now();
+        unsigned long long c0 = cycles();
+        result = fn(copy);
+        unsigned long long c = cycles() - c0;
+        double s = now() - t0;
+        if (i == 0 || s < best_s) {
+            best_s = s;
+            best_c = c;
+        }
+    }
+    printf("  %-26s %10zu %10.2f %10.3f\n", label, result,
+           best_c ? (double)len / best_c : 0.0, len / best_s / 1e9);
+    free(copy);
+}
+
+int main(int argc, char **argv) {
+    static const char *kernels[] = { "scalar", "sse2", "avx2" };
+    size_t sizes[16] = { 1, 4, 16 };
+    int nsizes = 3;
+
+    if (argc > 1) {
+        nsizes = 0;
+        for (int i = 1; i < argc && nsizes < 16; i++) {
+            sizes[nsizes++] = strtoul(argv[i], NULL, 10);
+        }
+    }
+
+    for (int s = 0; s < nsizes; s++) {
+        char *line = generate(sizes[s] << 20);
+        size_t len = strlen(line);
+
+        printf("%zu byte line\n", len);
+        printf("  %-26s %10s %10s %10s\n", "", "result", "bytes/cyc", "GB/s");
+        measure("libc searches", scan_libc, line, len);
+        for (int k = 0; k < 3; k++) {
+            char label[64];
+            if (scan_use_kernel(kernels[k]) == NULL) {
+                continue;
+            }
+            snprintf(label, sizeof(label), "classify (%s)", kernels[k]);
+            measure(label, scan_only, line, len);
+        }
+        for (int k = 0; k < 3; k++) {
+            char label[64];
+            if (scan_use_kernel(kernels[k]) == NULL) {
+                continue;
+            }
+            snprintf(label, sizeof(label), "scan (%s)", kernels[k]);
+            measure(label, scan_bitmap, line, len);
+        }
+        for (int k = 0; k < 3; k++) {
+            char label[64];
+            if (scan_use_kernel(kernels[k]) == NULL) {
+                continue;
+            }
+            snprintf(label, sizeof(label), "process_cmd_line (%s)", kernels[k]);
+            measure(label, parse_line, line, len);
+        }
+        scan_use_kernel(NULL);
+        free(line);
+        printf("\n");
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,85 @@
+#!/bin/sh
+# Representative workload for the shell, used to collect the profile for
+# 'make pgo' and to time the builds in bench/pgo-report.sh. It writes shell
+# input to stdout; save it to a file and feed that to the shell under test:
+#
+#   sh bench/workload.sh all > w.in
+#   SHELL_LINE_EDITOR=builtin ./shell < w.in > /dev/null
+#
+# The built-in line editor reads a file a block at a time. A pipe is read a
+# byte at a time, so commands can read the rest of it, and readline handles
+# its input a character at a time either way; both would dominate the run.
+#
+# Sections:
+#   parse     long lines of ;-separated assignments
+#   expand    lines dense with $VAR references
+#   glob      commands with wildcard arguments
+#   pipeline  multi-stage pipelines of short-lived commands
+#
+# Usage: bench/workload.sh [section|all] [rounds]
+
+SECTION=${1:-all}
+ROUNDS=${2:-1}
+SRC=$(cd "$(dirname "$0")/.." && pwd)
+
+# Repeats its stdin ROUNDS times
+repeat() {
+    body=$(cat)
+    i=0
+    while [ $i -lt "$ROUNDS" ]; do
+        printf '%s\n' "$body"
+        i=$((i + 1))
+    done
+}
+
+parse() {
+    awk 'BEGIN {
+        for (l = 0; l < 300; l++) {
+            line = ""
+            for (i = 0; i < 120; i++) {
+                line = line sprintf("V%d=value%d_%d ; ", i % 40, l, i)
+            }
+            print line "W=end"
+        }
+    }'
+}
+
+expand() {
+    awk 'BEGIN {
+        for (i = 0; i < 40; i++) printf("V%d=/usr/local/lib/v%d\n", i, i)
+        for (l = 0; l < 300; l++) {
+            line = "X="
+            for (i = 0; i < 200; i++) line = line sprintf("$V%d:", i % 40)
+            print line "$HOME:$PATH"
+        }
+    }'
+}
+
+glob() {
+    awk -v src="$SRC" 'BEGIN {
+        for (l = 0; l < 150; l++) {
+            print "true " src "/*.c " src "/*.h " src "/bench/* /usr/bin/* /etc/*.conf"
+        }
+    }'
+}
+
+pipeline() {
+    awk 'BEGIN {
+        for (l = 0; l < 150; l++) print "true | true | true | true"
+        for (l = 0; l < 100; l++) print "echo a b c | cat | cat > /dev/null"
+    }'
+}
+
+case $SECTION in
+    parse|expand|glob|pipeline)
+        $SECTION | repeat
+        ;;
+    all)
+        { parse; expand; glob; pipeline; } | repeat
+        ;;
+    *)
+        echo "usage: $0 [parse|expand|glob|pipeline|all] [rounds]" >&2
+        exit 2
+        ;;
+esac
+echo exit
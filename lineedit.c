@@ -0,0 +1,476 @@
+/*
+ * lineedit.c
+ * A minimal raw-mode line editor: prompt, cursor movement, history browsing
+ * with the arrow keys and Ctrl-R reverse search. It only needs termios, so a
+ * shell built with -DUSE_LINEEDIT starts faster and uses less memory than one
+ * linked against GNU readline.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <termios.h>
+#ifndef USE_LINEEDIT
+#include <readline/history.h>
+#endif
+#include "lineedit.h"
+
+#define LE_CTRL(c) ((c) & 0x1f)
+
+/* Keys that arrive as escape sequences are mapped above the byte range */
+enum le_key {
+   KEY_UP = 1000,
+   KEY_DOWN,
+   KEY_LEFT,
+   KEY_RIGHT,
+   KEY_HOME,
+   KEY_END,
+   KEY_DELETE
+};
+
+struct le_state {
+   char *buf;
+   size_t len;
+   size_t cap;
+   size_t pos;             /* cursor position in buf */
+   const char *prompt;
+   int history_index;      /* entry being shown, history_length for a new line */
+   char *saved;            /* the new line, kept while browsing history */
+};
+
+#ifdef USE_LINEEDIT
+/*
+ * The built-in history. Like a stifled readline history, the oldest entry is
+ * dropped once LE_HISTORY_MAX is reached and history_base moves up by one.
+ */
+int history_base = 1;
+int history_length = 0;
+static HIST_ENTRY *history_entries[LE_HISTORY_MAX + 1];
+
+void add_history(const char *line)
+{
+   HIST_ENTRY *entry = calloc(1, sizeof(HIST_ENTRY));
+
+   if (entry == NULL)
+      return;
+   entry->line = strdup(line);
+   if (history_length == LE_HISTORY_MAX) {
+      free(history_entries[0]->line);
+      free(history_entries[0]);
+      memmove(history_entries, history_entries + 1, (LE_HISTORY_MAX - 1) * sizeof(HIST_ENTRY *));
+      history_length--;
+      history_base++;
+   }
+   history_entries[history_length++] = entry;
+   history_entries[history_length] = NULL;
+}
+
+HIST_ENTRY **history_list(void)
+{
+   return history_length > 0 ? history_entries : NULL;
+}
+
+HIST_ENTRY *history_get(int offset)
+{
+   int index = offset - history_base;
+
+   if (index < 0 || index >= history_length)
+      return NULL;
+   return history_entries[index];
+}
+
+/*
+ * Searches backwards from the newest entry for one starting with string and
+ * returns its index in the history list, or -1.
+ */
+int history_search_prefix(const char *string, int direction)
+{
+   size_t len = strlen(string);
+
+   if (direction >= 0) {
+      for (int i = 0; i < history_length; i++)
+         if (strncmp(history_entries[i]->line, string, len) == 0)
+            return i;
+      return -1;
+   }
+   for (int i = history_length - 1; i >= 0; i--)
+      if (strncmp(history_entries[i]->line, string, len) == 0)
+         return i;
+   return -1;
+}
+#endif
+
+static const char *le_history_line(int index)
+{
+   HIST_ENTRY *entry = history_get(history_base + index);
+   return entry != NULL ? entry->line : NULL;
+}
+
+static void le_write(const char *data, size_t len)
+{
+   while (len > 0) {
+      ssize_t n = write(STDOUT_FILENO, data, len);
+      if (n <= 0) {
+         if (n == -1 && errno == EINTR)
+            continue;
+         return;
+      }
+      data += n;
+      len -= n;
+   }
+}
+
+static void le_set(struct le_state *ls, const char *text)
+{
+   size_t len = strlen(text);
+
+   if (len + 1 > ls->cap) {
+      ls->cap = len + 64;
+      ls->buf = realloc(ls->buf, ls->cap);
+   }
+   memcpy(ls->buf, text, len + 1);
+   ls->len = ls->pos = len;
+}
+
+/*
+ * Redraws the whole line in a single write: prompt, buffer, clear to the end
+ * of the line, then put the cursor back where it belongs.
+ */
+static void le_refresh(struct le_state *ls)
+{
+   size_t prompt_len = strlen(ls->prompt);
+   size_t size = prompt_len + ls->len + 32;
+   char *out = malloc(size);
+   size_t n = 0;
+
+   if (out == NULL)
+      return;
+   out[n++] = '\r';
+   memcpy(out + n, ls->prompt, prompt_len);
+   n += prompt_len;
+   memcpy(out + n, ls->buf, ls->len);
+   n += ls->len;
+   n += snprintf(out + n, size - n, "\x1b[K\r");
+   if (prompt_len + ls->pos > 0)
+      n += snprintf(out + n, size - n, "\x1b[%zuC", prompt_len + ls->pos);
+   le_write(out, n);
+   free(out);
+}
+
+static void le_insert(struct le_state *ls, char c)
+{
+   if (ls->len + 2 > ls->cap) {
+      ls->cap = ls->cap * 2 + 64;
+      ls->buf = realloc(ls->buf, ls->cap);
+   }
+   memmove(ls->buf + ls->pos + 1, ls->buf + ls->pos, ls->len - ls->pos + 1);
+   ls->buf[ls->pos++] = c;
+   ls->len++;
+}
+
+static void le_delete(struct le_state *ls, size_t from, size_t to)
+{
+   memmove(ls->buf + from, ls->buf + to, ls->len - to + 1);
+   ls->len -= to - from;
+   ls->pos = from;
+}
+
+static int le_read_byte(void)
+{
+   unsigned char c;
+   ssize_t n;
+
+   while ((n = read(STDIN_FILENO, &c, 1)) == -1 && errno == EINTR)
+      ;
+   return n == 1 ? c : -1;
+}
+
+/*
+ * Reads one key, turning the common ANSI escape sequences into le_key values.
+ */
+static int le_read_key(void)
+{
+   int c = le_read_byte();
+   int seq[3];
+
+   if (c != 0x1b)
+      return c;
+   if ((seq[0] = le_read_byte()) == -1 || (seq[1] = le_read_byte()) == -1)
+      return 0x1b;
+   if (seq[0] != '[' && seq[0] != 'O')
+      return 0;
+
+   switch (seq[1]) {
+   case 'A': return KEY_UP;
+   case 'B': return KEY_DOWN;
+   case 'C': return KEY_RIGHT;
+   case 'D': return KEY_LEFT;
+   case 'H': return KEY_HOME;
+   case 'F': return KEY_END;
+   }
+   if (isdigit(seq[1]) && (seq[2] = le_read_byte()) == '~') {
+      switch (seq[1]) {
+      case '1': case '7': return KEY_HOME;
+      case '4': case '8': return KEY_END;
+      case '3': return KEY_DELETE;
+      }
+   }
+   return 0;
+}
+
+static void le_history_move(struct le_state *ls, int direction)
+{
+   int index = ls->history_index + direction;
+   const char *line;
+
+   if (index < 0 || index > history_length)
+      return;
+   if (ls->history_index == history_length) {
+      free(ls->saved);
+      ls->saved = strdup(ls->buf);
+   }
+   ls->history_index = index;
+   line = index == history_length ? ls->saved : le_history_line(index);
+   le_set(ls, line != NULL ? line : "");
+}
+
+/*
+ * Ctrl-R reverse incremental search. Returns the key that ended the search so
+ * the caller can act on it, or 0 if it was consumed.
+ */
+static int le_search(struct le_state *ls)
+{
+   char query[256];
+   size_t qlen = 0;
+   int match = -1;
+   int from = history_length - 1;
+   char *original = strdup(ls->buf);
+
+   query[0] = '\0';
+   while (1) {
+      const char *found = match >= 0 ? le_history_line(match) : "";
+      char *out = malloc(strlen(query) + strlen(found) + 64);
+      int n = sprintf(out, "\r(reverse-i-search)`%s': %s\x1b[K", query, found);
+      le_write(out, n);
+      free(out);
+
+      int key = le_read_key();
+      if (key == LE_CTRL('r')) {
+         from = match - 1;
+      } else if (key == 127 || key == LE_CTRL('h')) {
+         if (qlen > 0)
+            query[--qlen] = '\0';
+         from = history_length - 1;
+      } else if (key >= 32 && key < 127 && qlen < sizeof(query) - 1) {
+         query[qlen++] = key;
+         query[qlen] = '\0';
+         from = match >= 0 ? match : history_length - 1;
+      } else if (key == LE_CTRL('g') || key == 0x1b || key == -1) {
+         le_set(ls, original);
+         free(original);
+         return 0;
+      } else {
+         /* Any other key accepts the match and is then handled normally */
+         if (match >= 0)
+            le_set(ls, le_history_line(match));
+         free(original);
+         return key;
+      }
+
+      match = -1;
+      for (int i = from; qlen > 0 && i >= 0; i--) {
+         const char *line = le_history_line(i);
+         if (line != NULL && strstr(line, query) != NULL) {
+            match = i;
+            break;
+         }
+      }
+   }
+}
+
+/*
+ * Edits one line in raw mode. Returns 0 when the line is done, -1 on EOF.
+ */
+static int le_edit(struct le_state *ls)
+{
+   le_refresh(ls);
+   while (1) {
+      int key = le_read_key();
+
+      if (key == LE_CTRL('r'))
+         key = le_search(ls);
+
+      switch (key) {
+      case -1:
+         return -1;
+      case 0:
+         break;
+      case '\r':
+      case '\n':
+         return 0;
+      case LE_CTRL('d'):
+         if (ls->len == 0)
+            return -1;
+         /* fall through */
+      case KEY_DELETE:
+         if (ls->pos < ls->len)
+            le_delete(ls, ls->pos, ls->pos + 1);
+         break;
+      case 127:
+      case LE_CTRL('h'):
+         if (ls->pos > 0)
+            le_delete(ls, ls->pos - 1, ls->pos);
+         break;
+      case LE_CTRL('a'):
+      case KEY_HOME:
+         ls->pos = 0;
+         break;
+      case LE_CTRL('e'):
+      case KEY_END:
+         ls->pos = ls->len;
+         break;
+      case LE_CTRL('b'):
+      case KEY_LEFT:
+         if (ls->pos > 0)
+            ls->pos--;
+         break;
+      case LE_CTRL('f'):
+      case KEY_RIGHT:
+         if (ls->pos < ls->len)
+            ls->pos++;
+         break;
+      case LE_CTRL('p'):
+      case KEY_UP:
+         le_history_move(ls, -1);
+         break;
+      case LE_CTRL('n'):
+      case KEY_DOWN:
+         le_history_move(ls, 1);
+         break;
+      case LE_CTRL('k'):
+         ls->buf[ls->pos] = '\0';
+         ls->len = ls->pos;
+         break;
+      case LE_CTRL('u'):
+         le_delete(ls, 0, ls->pos);
+         break;
+      case LE_CTRL('w'): {
+         size_t start = ls->pos;
+         while (start > 0 && ls->buf[start - 1] == ' ')
+            start--;
+         while (start > 0 && ls->buf[start - 1] != ' ')
+            start--;
+         le_delete(ls, start, ls->pos);
+         break;
+      }
+      case LE_CTRL('l'):
+         le_write("\x1b[H\x1b[2J", 7);
+         break;
+      default:
+         if (key >= 32 && key < 256 && key != 127)
+            le_insert(ls, (char)key);
+         break;
+      }
+      le_refresh(ls);
+   }
+}
+
+/*
+ * Without a terminal there is nothing to edit: read a plain line and echo it
+ * after the prompt, as readline does. stdio is not used, since it would read
+ * ahead into its buffer and leave nothing for the commands that share the
+ * input. A file is read a block at a time and the offset moved back to just
+ * after the line; anything else, such as a pipe, is read a byte at a time.
+ */
+static char *le_read_plain(const char *prompt)
+{
+   size_t cap = 256, len = 0;
+   char *line = malloc(cap);
+   int seekable = lseek(STDIN_FILENO, 0, SEEK_CUR) != -1;
+
+   fputs(prompt, stdout);
+   fflush(stdout);
+   if (line == NULL)
+      return NULL;
+   for (;;) {
+      if (cap - len < 2) {
+         char *grown = realloc(line, cap * 2);
+         if (grown == NULL)
+            break;
+         line = grown;
+         cap *= 2;
+      }
+      ssize_t got = read(STDIN_FILENO, line + len, seekable ? cap - len - 1 : 1);
+      if (got == -1 && errno == EINTR)
+         continue;
+      if (got <= 0)
+         break;
+      char *nl = memchr(line + len, '\n', got);
+      if (nl != NULL) {
+         if (seekable)
+            lseek(STDIN_FILENO, -(off_t)((line + len + got) - (nl + 1)), SEEK_CUR);
+         len = nl - line;
+         line[len] = '\0';
+         printf("%s\n", line);
+         fflush(stdout);
+         return line;
+      }
+      len += got;
+   }
+   /* A last line without a newline still counts */
+   if (len == 0) {
+      free(line);
+      return NULL;
+   }
+   line[len] = '\0';
+   printf("%s\n", line);
+   fflush(stdout);
+   return line;
+}
+
+/*
+ * Reads a line with the given prompt. The result is malloc'd and has no
+ * trailing newline; NULL means end of input, as with readline().
+ */
+char *le_readline(const char *prompt)
+{
+   struct termios original, raw;
+   struct le_state ls;
+   int result;
+
+   if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &original) == -1)
+      return le_read_plain(prompt);
+
+   /* Signals stay enabled so CTRL-C and friends still reach the shell */
+   raw = original;
+   raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+   raw.c_cflag |= CS8;
+   raw.c_lflag &= ~(ECHO | ICANON | IEXTEN);
+   raw.c_cc[VMIN] = 1;
+   raw.c_cc[VTIME] = 0;
+   fflush(stdout);
+   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
+      return le_read_plain(prompt);
+
+   memset(&ls, 0, sizeof(ls));
+   ls.prompt = prompt;
+   ls.history_index = history_length;
+   le_set(&ls, "");
+
+   result = le_edit(&ls);
+
+   tcsetattr(STDIN_FILENO, TCSAFLUSH, &original);
+   le_write("\n", 1);
+   free(ls.saved);
+   if (result == -1) {
+      free(ls.buf);
+      return NULL;
+   }
+   return ls.buf;
+}
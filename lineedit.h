@@ -0,0 +1,39 @@
+#ifndef _LINEEDIT_H
+#define _LINEEDIT_H
+
+/*
+ * lineedit.h
+ * A small raw-mode line editor that can stand in for GNU readline.
+ *
+ * Built with -DUSE_LINEEDIT the shell does not link readline at all, and this
+ * header provides the subset of the readline and history API the shell uses.
+ * In a readline build the editor can still be picked at run time by setting
+ * SHELL_LINE_EDITOR=builtin, in which case it shares readline's history.
+ */
+
+/*Number of history entries kept by the built-in history.*/
+#define LE_HISTORY_MAX 1000
+
+char *le_readline(const char *prompt);
+
+#ifdef USE_LINEEDIT
+
+typedef struct hist_entry {
+   char *line;
+   char *timestamp;
+   void *data;
+} HIST_ENTRY;
+
+extern int history_base;
+extern int history_length;
+
+void add_history(const char *line);
+HIST_ENTRY **history_list(void);
+HIST_ENTRY *history_get(int offset);
+int history_search_prefix(const char *string, int direction);
+
+#define readline le_readline
+
+#endif
+
+#endif
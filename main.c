@@ -1,3 +1,6 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,18 +10,110 @@
 #include <glob.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <sched.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#ifndef USE_LINEEDIT
 #include <readline/readline.h>
 #include <readline/history.h>
+#endif
+#include "lineedit.h"
 #include <errno.h>
 #include "parser.h"
 
 //Global Variable
 pid_t child_pid = 0;
 
+// Set when lines are read with the built-in editor instead of readline
+int use_line_editor = 0;
+
+// Shell options toggled with 'set -o'
+int opt_batch = 0;
+int opt_pipefail = 0;
+int opt_failfast = 0;
+
+// Set while running the last line of a -c string: its final command is
+// exec'd in place of the shell rather than forked
+int exec_last = 0;
+int exec_final = 0;
+
+// Exit status of the last foreground command and background job bookkeeping
+#define MAX_JOBS 128
+int last_status = 0;
+int pipe_status[CMD_LENGTH];
+int pipe_status_count = 1;
+pid_t bg_pids[MAX_JOBS];
+volatile sig_atomic_t job_count = 0;
+
+// Current directory as last set by cd, so it need not be asked for again
+char *shell_cwd = NULL;
+
+// Generation counters bumped whenever an input of the prompt changes
+unsigned long cwd_generation = 1;
+unsigned long status_generation = 1;
+unsigned long line_generation = 1;
+volatile sig_atomic_t job_generation = 1;
+
+// Session record state (see record_open)
+static int record_fd = -1;
+static char *record_line = NULL;
+static char *record_cwd = NULL;
+static long long record_start = 0;
+static long long record_wall = 0;
+
+// Execution trace state (see trace_open)
+#define TRACE_RING_SIZE 512
+
+struct trace_event {
+    const char *name;
+    long long ts;
+    long long dur;
+    int cmd_index;
+    pid_t pid;
+    int argc;
+};
+
+static struct trace_event trace_ring[TRACE_RING_SIZE];
+static int trace_count = 0;
+static int trace_fd = -1;
+int trace_enabled = 0;
+int trace_cmd_index = 0;
+
 // Forward declarations
 void execmd(command* cmd);
 void executeCommand(command **cmd_line);
 void set_prompt(char *new_prompt, char **prompt, const char *default_prompt);
+void prompt_compile(const char *template);
+const char *prompt_render(void);
+void set_last_status(int code);
+int wait_for_child(pid_t pid);
+int decode_status(int status);
+void set_pipe_status(const int *codes, int n);
+int wait_any_child(pid_t *pids, int n, int *status);
+void add_job(pid_t pid);
+void completion_init(void);
+int apply_exec_prefixes(command *cmd);
+void exec_child(command *cmd, int append);
+void exec_in_place(command *cmd);
+int strip_each_prefix(command *cmd, int *parallel);
+size_t argv_size(char **argv);
+size_t arg_limit(void);
+int argv_count(char **argv);
+void run_batched(command *cmd, int parallel, const char *from_glob);
+void cd_db_record(const char *dir);
+const char *cd_db_jump(const char *pattern);
+int execute_fanout(char *line);
+char *expand_process_substitutions(char *line);
+void procsub_finish(int background);
 void signal_handler(int signal_number);
 void sigchld_handler(int signo);
 void setup_sigchld_handler();
@@ -26,12 +121,36 @@ void executePipeline(command **pipeline, int num_cmds, int background);
 void execute_history_command(const char *line);
 void handle_history_command(const char *line);
 char* expand_environment_variables(char* input);
-
-int main() {
+char *special_variable(const char *name);
+void var_init(void);
+const char *var_get(const char *name);
+void var_set(const char *name, const char *value, int export);
+void var_unset(const char *name);
+void var_sync_environ(void);
+int is_valid_name(const char *word);
+int is_assignment(const char *word);
+int only_assignments(char **argv);
+void builtin_export(char **argv);
+void builtin_unset(char **argv);
+void builtin_set(char **argv);
+void trace_open(const char *path);
+void trace_close(void);
+void trace_child_reset(void);
+long long trace_now(void);
+void trace_event(const char *name, long long start, int cmd_index, pid_t pid, char **argv);
+void record_open(const char *path);
+void record_close(void);
+void record_child_reset(void);
+void record_begin(const char *line);
+void record_end(void);
+void run_line(char *line, int interactive);
+int execute_line(char *line);
+int run_command_string(const char *string);
+
+int main(int argc, char **argv) {
     char *line;
     char *default_prompt = strdup("default% ");
     char *current_prompt = strdup(default_prompt); // Default prompt
-    command **cmd_line;
 
     // Set up the signal handler for SIGCHLD to handle zombie processes
     setup_sigchld_handler();
@@ -46,8 +165,45 @@ int main() {
     sigaction(SIGQUIT, &sa, NULL); 
     sigaction(SIGTSTP, &sa, NULL); 
 
+    // Variables start out as a copy of the inherited environment
+    var_init();
+#ifdef USE_LINEEDIT
+    use_line_editor = 1;
+#else
+    rl_change_environment = 0;
+    use_line_editor = var_get("SHELL_LINE_EDITOR") != NULL && strcmp(var_get("SHELL_LINE_EDITOR"), "builtin") == 0;
+#endif
+
+    // Start tracing right away if requested through the environment
+    if (getenv("SHELL_TRACE") != NULL && *getenv("SHELL_TRACE") != '\0') {
+        trace_open(getenv("SHELL_TRACE"));
+    }
+    atexit(trace_close);
+
+    // Likewise for recording the session
+    if (getenv("SHELL_RECORD") != NULL && *getenv("SHELL_RECORD") != '\0') {
+        record_open(getenv("SHELL_RECORD"));
+    }
+    atexit(record_close);
+
+    shell_cwd = getcwd(NULL, 0);
+
+    // shell -c string runs the string and exits without reading input
+    if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+        if (argc < 3) {
+            fprintf(stderr, "%s: -c: option requires an argument\n", argv[0]);
+            exit(2);
+        }
+        exit(run_command_string(argv[2]));
+    }
+
+    prompt_compile(current_prompt);
+    completion_init();
+
     while (1) {
-        line = readline(current_prompt);
+        // The previous line, however it was handled, is done by now
+        record_end();
+        line = use_line_editor ? le_readline(prompt_render()) : readline(prompt_render());
 
         //CTRL D
         if (line == NULL) {
@@ -62,6 +218,8 @@ int main() {
                 break;
         }
 
+        record_begin(line);
+
         // Check for prompt change command and handle it
         if (strncmp(line, "prompt ", 7) == 0)
         {
@@ -70,7 +228,7 @@ int main() {
         }
 
         // Handle history command
-        if (strcmp(line, "history") == 0) {
+        if (strncmp(line, "history", 7) == 0 && line[7 + strspn(line + 7, " \t")] == '\0') {
             handle_history_command(line);
             free(line);
             continue;
@@ -85,15 +243,7 @@ int main() {
 
         // If the line is not empty, execute the commands
         if (line && *line) {
-            char* expanded_line = expand_environment_variables(line);
-            free(line); // Free the original line
-            line = expanded_line; // Use the expanded line for further processing
-
-            add_history(line); // add readline's history feature
-            cmd_line = process_cmd_line(line, 1); // Parse the command line into an array of command structures
-            executeCommand(cmd_line); // Execute parsed commands
-            clean_up(cmd_line); // Clean up memory
-            free(line); // Free the input line
+            run_line(line, 1);
         } else {
             free(line); // Free the input line if it's empty
         }
@@ -105,6 +255,90 @@ int main() {
     return 0;
 }
 
+// Function to expand, parse and run one line of input, which is freed.
+// Interactive lines are also added to the history.
+void run_line(char *line, int interactive) {
+    long long t0 = trace_now();
+    char* expanded_line = expand_environment_variables(line);
+    free(line); // Free the original line
+    line = expanded_line; // Use the expanded line for further processing
+    trace_event("expand", t0, -1, getpid(), NULL);
+
+    if (interactive) {
+        add_history(line); // add readline's history feature
+    }
+
+    // Start any <(cmd) and >(cmd) and put their /dev/fd paths in
+    expanded_line = expand_process_substitutions(line);
+    free(line);
+    line = expanded_line;
+
+    // Substitutions used by a background job live as long as the job does
+    procsub_finish(execute_line(line));
+    line_generation++;
+    free(line); // Free the input line
+}
+
+// Function to run one expanded line, either as a fan-out or as ordinary
+// commands. Returns 1 if any command on it was put in the background.
+int execute_line(char *line) {
+    if (execute_fanout(line)) {
+        // The line was a fan-out and has already been run
+        return 0;
+    }
+    long long t0 = trace_now();
+    command **cmd_line = process_cmd_line(line, 1); // Parse the command line into an array of command structures
+    trace_event("parse", t0, -1, getpid(), NULL);
+    executeCommand(cmd_line); // Execute parsed commands
+    int background = 0;
+    for (int i = 0; cmd_line[i] != NULL; i++) {
+        background |= cmd_line[i]->background;
+    }
+    clean_up(cmd_line); // Clean up memory
+    return background;
+}
+
+// Function to run the string given with -c, one line at a time. As in other
+// shells, the final command of the last line is exec'd by the shell itself
+// when it is a plain foreground command, which saves a fork and lets signals
+// sent to the shell reach it directly. Returns the exit status.
+int run_command_string(const char *string) {
+    char *copy = strdup(string);
+    char *rest = copy;
+    char *part;
+
+    while ((part = strsep(&rest, "\n")) != NULL) {
+        // Blank lines are skipped so a trailing newline still ends in an exec
+        if (part[strspn(part, " \t")] == '\0') {
+            continue;
+        }
+        exec_last = rest == NULL || rest[strspn(rest, " \t\n")] == '\0';
+        run_line(strdup(part), 0);
+    }
+    exec_last = 0;
+    free(copy);
+    return last_status;
+}
+
+// Function to replace the shell with a command, as the last step of -c
+void exec_in_place(command *cmd) {
+    // Nothing buffered may be lost, and exit handlers will not run
+    fflush(NULL);
+    trace_close();
+
+    // A background job earlier in the string leaves the timeout alarm set,
+    // and its handler would not survive the exec; SIGALRM would kill the
+    // command instead
+    alarm(0);
+    signal(SIGALRM, SIG_DFL);
+
+    // Signals blocked around forks must not stay blocked in the command
+    sigset_t empty;
+    sigemptyset(&empty);
+    sigprocmask(SIG_SETMASK, &empty, NULL);
+    exec_child(cmd, 0);
+}
+
 // Function to change the shell prompt dynamically
 void set_prompt(char *new_prompt, char **prompt, const char *default_prompt){
     if (new_prompt == NULL || *new_prompt == '\0' || isspace((unsigned char)*new_prompt))
@@ -114,6 +348,7 @@ void set_prompt(char *new_prompt, char **prompt, const char *default_prompt){
         {
             free(*prompt);
             *prompt = strdup(default_prompt);
+            prompt_compile(*prompt);
         }
         return;
     }
@@ -130,6 +365,7 @@ void set_prompt(char *new_prompt, char **prompt, const char *default_prompt){
         // Copy new prompt and append a space and null terminator
         snprintf(*prompt, strlen(new_prompt) + 2, "%s ", new_prompt);
         printf("Setting prompt to: %s\n", *prompt);
+        prompt_compile(*prompt);
     }
 }
 
@@ -144,10 +380,85 @@ void builtin_pwd() {
 }
 
 // Built-in 'cd' command implementation
-void builtin_cd(char *path) {
+static int change_dir(const char *path) {
     if (chdir(path) != 0) {
+        return -1;
+    }
+
+    char *new_dir = getcwd(NULL, 0);
+    if (shell_cwd != NULL) {
+        var_set("OLDPWD", shell_cwd, 1);
+    }
+    free(shell_cwd);
+    shell_cwd = new_dir;
+    if (shell_cwd != NULL) {
+        var_set("PWD", shell_cwd, 1);
+        cd_db_record(shell_cwd);
+    }
+    cwd_generation++;
+    return 0;
+}
+
+void builtin_cd(const char *path) {
+    if (path == NULL) {
+        fprintf(stderr, "cd: HOME not set\n");
+        set_last_status(1);
+        return;
+    }
+    if (change_dir(path) != 0) {
         perror("cd");
+        set_last_status(1);
+        return;
+    }
+    set_last_status(0);
+}
+
+// Function to look a relative directory up in CDPATH before the current one
+void builtin_cd_search(char *path) {
+    const char *cdpath = var_get("CDPATH");
+
+    if (cdpath != NULL && *cdpath != '\0' && path[0] != '/'
+        && strcmp(path, ".") != 0 && strcmp(path, "..") != 0
+        && strncmp(path, "./", 2) != 0 && strncmp(path, "../", 3) != 0) {
+        char *copy = strdup(cdpath);
+        char *rest = copy;
+        char *entry;
+        while ((entry = strsep(&rest, ":")) != NULL) {
+            char *candidate = malloc(strlen(entry) + strlen(path) + 3);
+            sprintf(candidate, "%s/%s", *entry != '\0' ? entry : ".", path);
+            int found = change_dir(candidate) == 0;
+            free(candidate);
+            if (found) {
+                // Like bash, say where we ended up when CDPATH was used
+                if (*entry != '\0' && shell_cwd != NULL) {
+                    printf("%s\n", shell_cwd);
+                }
+                free(copy);
+                set_last_status(0);
+                return;
+            }
+        }
+        free(copy);
+    }
+    builtin_cd(path);
+}
+
+// Function to jump to the best frecency match for a pattern
+void builtin_cd_jump(char *pattern) {
+    const char *dir;
+
+    if (pattern == NULL) {
+        fprintf(stderr, "cd: -j: pattern required\n");
+        set_last_status(2);
+        return;
+    }
+    if ((dir = cd_db_jump(pattern)) == NULL) {
+        fprintf(stderr, "cd: -j: no match for %s\n", pattern);
+        set_last_status(1);
+        return;
     }
+    printf("%s\n", dir);
+    builtin_cd(dir);
 }
 
 // Signal handler for SIGINT, SIGQUIT, and SIGTSTP
@@ -183,8 +494,25 @@ void sigchld_handler(int signo) {
     int status;
     pid_t pid;
 
+    int saved_errno = errno;
+
     // Wait for all children without blocking
     while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        // Only background jobs are reported, anything else is a helper child
+        int is_job = 0;
+        for (int i = 0; i < MAX_JOBS; i++) {
+            if (bg_pids[i] == pid) {
+                bg_pids[i] = 0;
+                job_count--;
+                job_generation++;
+                is_job = 1;
+                break;
+            }
+        }
+        if (!is_job) {
+            continue;
+        }
+
         // Reap zombie processes
         if (WIFEXITED(status)) {
             printf("[Background job with PID %d finished with exit code %d]\n", pid, WEXITSTATUS(status));
@@ -192,6 +520,105 @@ void sigchld_handler(int signo) {
             printf("[Background job with PID %d finished due to signal %d]\n", pid, WTERMSIG(status));
         }
     }
+    errno = saved_errno;
+}
+
+// Function to remember a background job so SIGCHLD can report it
+void add_job(pid_t pid) {
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (bg_pids[i] == 0) {
+            bg_pids[i] = pid;
+            job_count++;
+            job_generation++;
+            return;
+        }
+    }
+}
+
+// Function to wait for a foreground child, returns its wait status or -1
+int wait_for_child(pid_t pid) {
+    int status;
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return status;
+}
+
+// Function to record the exit status shown by the prompt
+void set_last_status(int code) {
+    pipe_status[0] = code;
+    pipe_status_count = 1;
+    if (code != last_status) {
+        last_status = code;
+        status_generation++;
+    }
+}
+
+// Function to record the statuses of every stage of a pipeline. With
+// pipefail the pipeline fails with its rightmost failing stage.
+void set_pipe_status(const int *codes, int n) {
+    int code = codes[n - 1];
+
+    if (opt_pipefail) {
+        for (int i = 0; i < n; i++) {
+            if (codes[i] != 0) {
+                code = codes[i];
+            }
+        }
+    }
+    set_last_status(code);
+    if (n > CMD_LENGTH) {
+        n = CMD_LENGTH;
+    }
+    memcpy(pipe_status, codes, n * sizeof(int));
+    pipe_status_count = n;
+}
+
+// Function to wait for whichever of the given children finishes first.
+// SIGCHLD must be blocked by the caller; entries that are 0 are skipped.
+// Returns the index of the child reaped, or -1 if there is none left.
+int wait_any_child(pid_t *pids, int n, int *status) {
+    sigset_t chld_mask;
+    sigemptyset(&chld_mask);
+    sigaddset(&chld_mask, SIGCHLD);
+
+    while (1) {
+        int waiting = 0;
+        for (int i = 0; i < n; i++) {
+            if (pids[i] <= 0) {
+                continue;
+            }
+            waiting = 1;
+            pid_t pid = waitpid(pids[i], status, WNOHANG);
+            if (pid == pids[i]) {
+                return i;
+            }
+            if (pid == -1 && errno == ECHILD) {
+                *status = -1;
+                return i;
+            }
+        }
+        if (!waiting) {
+            return -1;
+        }
+        if (sigwaitinfo(&chld_mask, NULL) == -1 && errno != EINTR) {
+            perror("sigwaitinfo");
+            return -1;
+        }
+    }
+}
+
+// Function to turn a wait status into a shell exit code
+int decode_status(int status) {
+    if (status == -1) {
+        return 127;
+    }
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return WEXITSTATUS(status);
 }
 
 void alarm_handler(int signum)
@@ -221,10 +648,12 @@ void setup_sigchld_handler() {
 }
 
 
-// Built-in wild card function
-void expand_wildcards(command* cmd) {
+// Built-in wild card function. If from_glob is not NULL it is set to an
+// array with one flag per new argument, set for the words a pattern matched.
+void expand_wildcards(command* cmd, char **from_glob) {
     glob_t glob_result;
     char **new_argv = NULL;
+    char *matched = NULL;
     int new_argc = 0;
     size_t alloc_size = 0;
 
@@ -233,9 +662,15 @@ void expand_wildcards(command* cmd) {
         memset(&glob_result, 0, sizeof(glob_result));
         // Use GLOB_NOCHECK to ensure non-matching patterns are returned
         if (glob(cmd->argv[i], GLOB_NOCHECK | GLOB_TILDE | GLOB_APPEND, NULL, &glob_result) == 0) {
+            // A word without wildcards, or a pattern that matched nothing,
+            // comes back as itself
+            int is_match = strpbrk(cmd->argv[i], "*?[") != NULL
+                && !(glob_result.gl_pathc == 1 && strcmp(glob_result.gl_pathv[0], cmd->argv[i]) == 0);
             alloc_size += sizeof(char*) * (glob_result.gl_pathc + 1);
             new_argv = realloc(new_argv, alloc_size);
+            matched = realloc(matched, alloc_size / sizeof(char*));
             for (size_t j = 0; j < glob_result.gl_pathc; j++) {
+                matched[new_argc] = is_match;
                 new_argv[new_argc++] = strdup(glob_result.gl_pathv[j]);
             }
         }
@@ -243,6 +678,12 @@ void expand_wildcards(command* cmd) {
     }
     new_argv[new_argc] = NULL; // Terminate the new argv with NULL
 
+    if (from_glob != NULL) {
+        *from_glob = matched;
+    } else {
+        free(matched);
+    }
+
     // Free the old argv
     for (int i = 0; cmd->argv[i] != NULL; i++) {
         free(cmd->argv[i]);
@@ -261,6 +702,9 @@ void executeCommand(command **cmd_line) {
         int background = cmd_line[i]->background;
         int num_cmds = 1;
 
+        trace_cmd_index = i;
+        var_sync_environ();
+
         if (cmd_line[i]->pipe_to) {
             // Count the number of commands in the pipeline
             while (cmd_line[i + num_cmds] && cmd_line[i + num_cmds]->pipe_to) {
@@ -280,15 +724,17 @@ void executeCommand(command **cmd_line) {
             i++;
         } else if (strcmp(cmd_line[i]->com_name, "cd") == 0) {
             // Handle 'cd' built-in command
-            char *current_dir = getcwd(NULL, 0); // Get the current working directory
-
             // If no argument is given, or if it is "~", change to the home directory
             if (cmd_line[i]->argv[1] == NULL || strcmp(cmd_line[i]->argv[1], "~") == 0) {
-                builtin_cd(getenv("HOME"));
+                builtin_cd(var_get("HOME"));
+            }
+            else if (strcmp(cmd_line[i]->argv[1], "-j") == 0) {
+                // Jump to a frequently and recently visited directory
+                builtin_cd_jump(cmd_line[i]->argv[2]);
             }
             else if (strcmp(cmd_line[i]->argv[1], "-") == 0) {
                 // Change to the last directory
-                char *last_dir = getenv("OLDPWD");
+                const char *last_dir = var_get("OLDPWD");
                 if (last_dir != NULL) {
                     builtin_cd(last_dir);
                 } else {
@@ -297,7 +743,10 @@ void executeCommand(command **cmd_line) {
             }
             else if (cmd_line[i]->argv[1][0] == '~' && cmd_line[i]->argv[1][1] == '/') {
                 // Change to a subdirectory of the home directory
-                char *home_dir = getenv("HOME");
+                const char *home_dir = var_get("HOME");
+                if (home_dir == NULL) {
+                    home_dir = "";
+                }
                 char *subdir_path = malloc(strlen(home_dir) + strlen(cmd_line[i]->argv[1]) - 1); // -1 to exclude '~'
                 strcpy(subdir_path, home_dir);
                 strcat(subdir_path, cmd_line[i]->argv[1] + 1); // Skip the '~' character
@@ -307,19 +756,37 @@ void executeCommand(command **cmd_line) {
                 free(subdir_path);
             } else {
                 // Change to the directory specified by the argument
-                builtin_cd(cmd_line[i]->argv[1]);
+                builtin_cd_search(cmd_line[i]->argv[1]);
             }
 
-            // Update the "OLDPWD" environment variable
-            setenv("OLDPWD", current_dir, 1);
-
-            // Free the memory allocated by getcwd
-            free(current_dir);
-
+            i++;
+        } else if (strcmp(cmd_line[i]->com_name, "set") == 0) {
+            // Handle 'set' built-in command
+            builtin_set(cmd_line[i]->argv);
+            i++;
+        } else if (strcmp(cmd_line[i]->com_name, "export") == 0) {
+            // Handle 'export' built-in command
+            builtin_export(cmd_line[i]->argv);
+            i++;
+        } else if (strcmp(cmd_line[i]->com_name, "unset") == 0) {
+            // Handle 'unset' built-in command
+            builtin_unset(cmd_line[i]->argv);
+            i++;
+        } else if (is_assignment(cmd_line[i]->com_name) && only_assignments(cmd_line[i]->argv)) {
+            // NAME=value on its own sets a shell variable
+            for (int j = 0; cmd_line[i]->argv[j] != NULL; j++) {
+                char *eq = strchr(cmd_line[i]->argv[j], '=');
+                *eq = '\0';
+                var_set(cmd_line[i]->argv[j], eq + 1, -1);
+                *eq = '=';
+            }
+            set_last_status(0);
             i++;
         } else {
             // Execute a single external command using execmd
+            exec_final = exec_last && cmd_line[i + 1] == NULL;
             execmd(cmd_line[i]);
+            exec_final = 0;
             i++;
         }
     }
@@ -327,85 +794,82 @@ void executeCommand(command **cmd_line) {
 
 void execmd(command *cmd)
 {
-    expand_wildcards(cmd);
+    int parallel = 1;
+    int batch = strip_each_prefix(cmd, &parallel);
+    if (batch == -1)
+    {
+        set_last_status(2);
+        return;
+    }
+
+    long long t0 = trace_now();
+    char *from_glob = NULL;
+    expand_wildcards(cmd, &from_glob);
+    trace_event("glob", t0, trace_cmd_index, getpid(), cmd->argv);
+
+    // Split argument lists the kernel would reject with E2BIG. Only words
+    // that came from a wildcard are spread over the batches
+    if ((batch || opt_batch) && argv_size(cmd->argv) > arg_limit()
+        && memchr(from_glob, 1, argv_count(cmd->argv)) != NULL)
+    {
+        run_batched(cmd, parallel, from_glob);
+        free(from_glob);
+        return;
+    }
+    free(from_glob);
     // Check if the command should run in the background
     int background = cmd->background;
-    (void)background;
 
+    // The final command of a -c string takes over the shell process
+    if (exec_final && !background)
+    {
+        exec_in_place(cmd);
+    }
+
+    // Hold SIGCHLD until we have waited for (or registered) the child,
+    // otherwise the handler could reap it and lose its status
+    sigset_t chld_mask, old_mask;
+    sigemptyset(&chld_mask);
+    sigaddset(&chld_mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld_mask, &old_mask);
+
+    long long fork_ts = trace_now();
     pid_t pid = fork();
     if (pid == -1)
     {
         perror("fork");
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
         return;
     }
 
     if (pid == 0)
     { // Child process
-        
-
-        // Handle input redirection
-        if (cmd->redirect_in != NULL)
-        {
-            int in_fd = open(cmd->redirect_in, O_RDONLY);
-            if (in_fd < 0)
-            {
-                perror("open input redirection");
-                exit(EXIT_FAILURE);
-            }
-            dup2(in_fd, STDIN_FILENO);
-            close(in_fd);
-        }
-
-        // Handle output redirection
-        if (cmd->redirect_out != NULL)
-        {
-            int out_fd = open(cmd->redirect_out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (out_fd < 0)
-            {
-                perror("open output redirection");
-                exit(EXIT_FAILURE);
-            }
-            dup2(out_fd, STDOUT_FILENO);
-            close(out_fd);
-        }
-
-        // Handle error redirection
-        if (cmd->redirect_err != NULL)
-        {
-            int err_fd = open(cmd->redirect_err, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (err_fd < 0)
-            {
-                perror("open error redirection");
-                exit(EXIT_FAILURE);
-            }
-            dup2(err_fd, STDERR_FILENO);
-            close(err_fd);
-        }
-
-        // Execute the command
-        if (execvp(cmd->com_name, cmd->argv) == -1)
-        {
-            perror("execvp");
-            exit(EXIT_FAILURE);
-        }
+        trace_child_reset();
+        record_child_reset();
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
+        exec_child(cmd, 0);
     }
     else if (pid > 0)
     {
         // Parent process
+        trace_event("fork", fork_ts, trace_cmd_index, getpid(), cmd->argv);
         child_pid = pid;
         signal(SIGALRM, alarm_handler);
         alarm(60); // Set timer for 5 seconds
         
         if (!cmd->background)
         {
-            int status;
-            waitpid(pid, &status, 0);
+            int status = wait_for_child(pid);
             alarm(0); // Cancel the alarm
+            trace_event("exec", fork_ts, trace_cmd_index, pid, cmd->argv);
+            set_last_status(decode_status(status));
         }
         else
         {
+            add_job(pid);
             printf("[Started background job with PID %d]\n", pid);
         }
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
     }
     else
     {
@@ -413,9 +877,66 @@ void execmd(command *cmd)
     }
 }
 
+// Function to set up redirections and exec a command in a forked child.
+// With append set, output files are appended to instead of truncated.
+void exec_child(command *cmd, int append)
+{
+    if (apply_exec_prefixes(cmd) == -1)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    // Handle input redirection
+    if (cmd->redirect_in != NULL)
+    {
+        int in_fd = open(cmd->redirect_in, O_RDONLY);
+        if (in_fd < 0)
+        {
+            perror("open input redirection");
+            exit(EXIT_FAILURE);
+        }
+        dup2(in_fd, STDIN_FILENO);
+        close(in_fd);
+    }
+
+    // Handle output redirection
+    if (cmd->redirect_out != NULL)
+    {
+        int out_fd = open(cmd->redirect_out, O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC), 0644);
+        if (out_fd < 0)
+        {
+            perror("open output redirection");
+            exit(EXIT_FAILURE);
+        }
+        dup2(out_fd, STDOUT_FILENO);
+        close(out_fd);
+    }
+
+    // Handle error redirection
+    if (cmd->redirect_err != NULL)
+    {
+        int err_fd = open(cmd->redirect_err, O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC), 0644);
+        if (err_fd < 0)
+        {
+            perror("open error redirection");
+            exit(EXIT_FAILURE);
+        }
+        dup2(err_fd, STDERR_FILENO);
+        close(err_fd);
+    }
+
+    // Execute the command
+    if (execvp(cmd->com_name, cmd->argv) == -1)
+    {
+        perror("execvp");
+        exit(EXIT_FAILURE);
+    }
+}
+
 void executePipeline(command **pipeline, int num_cmds, int background) {
     int pipefds[num_cmds - 1][2]; // Array to hold the pipe file descriptors
     pid_t pids[num_cmds];
+    long long fork_ts[num_cmds];
 
     if (num_cmds == 0) {
         printf("Empty command.\n");
@@ -430,9 +951,18 @@ void executePipeline(command **pipeline, int num_cmds, int background) {
         }
     }
 
+    sigset_t chld_mask, old_mask;
+    sigemptyset(&chld_mask);
+    sigaddset(&chld_mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld_mask, &old_mask);
+
     for (int i = 0; i < num_cmds; i++) {
+        fork_ts[i] = trace_now();
         pids[i] = fork();
         if (pids[i] == 0) { // Child process
+            trace_child_reset();
+            record_child_reset();
+            sigprocmask(SIG_SETMASK, &old_mask, NULL);
             // Handle input from the previous command, if not the first command
             if (i > 0) {
                 dup2(pipefds[i - 1][0], STDIN_FILENO);
@@ -468,19 +998,14 @@ void executePipeline(command **pipeline, int num_cmds, int background) {
                 dup2(pipefds[i][1], STDOUT_FILENO);
             }
 
-            // Check for redirection and call execmd if needed
-            if (pipeline[i]->redirect_out != NULL || pipeline[i]->redirect_err != NULL) {
-                execmd(pipeline[i]);
-            } else {
-                // Execute the command
-                execvp(pipeline[i]->com_name, pipeline[i]->argv);
-                perror("execvp");
-                exit(EXIT_FAILURE);
-            }
+            // Apply the stage's own redirections and execute it. This must
+            // not go through execmd, which would fork again and return here
+            exec_child(pipeline[i], 0);
         } else if (pids[i] < 0) {
             perror("fork");
             exit(EXIT_FAILURE);
         }
+        trace_event("fork", fork_ts[i], trace_cmd_index + i, getpid(), pipeline[i]->argv);
     }
 
     // Parent process closes all pipe file descriptors
@@ -491,16 +1016,44 @@ void executePipeline(command **pipeline, int num_cmds, int background) {
 
     // Wait for all child processes if not in the background
     if (!background) {
+        int codes[num_cmds];
+        pid_t running[num_cmds];
         int status;
-        for (int i = 0; i < num_cmds; i++) {
-            waitpid(pids[i], &status, 0);
+        int failed = 0;
+
+        memcpy(running, pids, sizeof(running));
+        // Stages are reaped as they finish so a failure is noticed at once
+        for (int left = num_cmds; left > 0; left--) {
+            int i = wait_any_child(running, num_cmds, &status);
+            if (i == -1) {
+                break;
+            }
+            running[i] = 0;
+            codes[i] = decode_status(status);
+            trace_event("exec", fork_ts[i], trace_cmd_index + i, pids[i], pipeline[i]->argv);
+
+            // With failfast, stop the rest of the pipeline instead of letting
+            // it work on input that is going to be thrown away
+            if (opt_failfast && codes[i] != 0 && !failed) {
+                failed = 1;
+                for (int j = 0; j < num_cmds; j++) {
+                    if (running[j] > 0) {
+                        kill(running[j], SIGTERM);
+                    }
+                }
+            }
         }
+        // We may have swallowed the SIGCHLD of a background job
+        sigchld_handler(SIGCHLD);
+        set_pipe_status(codes, num_cmds);
     } else {
         // For background processes print their PIDs 
         for (int i = 0; i < num_cmds; i++) {
+            add_job(pids[i]);
             printf("[Started background job with PID %d]\n", pids[i]);
         }
     }
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
 }
 
 // Function to handle 'history' built-in command
@@ -528,11 +1081,8 @@ void execute_history_command(const char *line) {
         HIST_ENTRY *hist_entry = history_get(history_base + cmd_number);
         if (hist_entry && hist_entry->line) {
             printf("%s\n", hist_entry->line);
-            command **cmd_line = process_cmd_line(hist_entry->line, 1); // Parse the command line
-            if (cmd_line) {
-                executeCommand(cmd_line); // Execute the parsed command
-                clean_up(cmd_line); // Clean up after execution
-            }
+            // The line gets the same expansions as typed input
+            run_line(strdup(hist_entry->line), 0);
         } else {
             printf("No such command in history.\n");
         }
@@ -542,11 +1092,7 @@ void execute_history_command(const char *line) {
             HIST_ENTRY *hist_entry = history_get(history_base + offset);
             if (hist_entry && hist_entry->line) {
                 printf("%s\n", hist_entry->line);
-                command **cmd_line = process_cmd_line(hist_entry->line, 1); // Parse the command line
-                if (cmd_line) {
-                    executeCommand(cmd_line); // Execute the parsed command
-                    clean_up(cmd_line); // Clean up after execution
-                }
+                run_line(strdup(hist_entry->line), 0);
             } else {
                 printf("No such command in history.\n");
             }
@@ -556,6 +1102,25 @@ void execute_history_command(const char *line) {
     }
 }
 
+// Function to look up variables the shell maintains itself
+char *special_variable(const char *name) {
+    static char buf[CMD_LENGTH * 12];
+
+    if (strcmp(name, "?") == 0) {
+        snprintf(buf, sizeof(buf), "%d", last_status);
+        return buf;
+    }
+    if (strcmp(name, "PIPESTATUS") == 0) {
+        size_t len = 0;
+        buf[0] = '\0';
+        for (int i = 0; i < pipe_status_count; i++) {
+            len += snprintf(buf + len, sizeof(buf) - len, i == 0 ? "%d" : " %d", pipe_status[i]);
+        }
+        return buf;
+    }
+    return NULL;
+}
+
 // Functions to handle environment
 char* expand_environment_variables(char* input) {
     char* expanded_input = strdup(input); // Duplicate the input to avoid modifying the original
@@ -563,10 +1128,12 @@ char* expand_environment_variables(char* input) {
     while ((start = strchr(start, '$')) != NULL) { // Find the '$' symbol
         char* end = start + 1;
         while (isalnum(*end) || *end == '_') end++; // Find the end of the variable name
+        if (end == start + 1 && *end == '?') end++; // $? is the only one-character name
         size_t var_name_length = end - (start + 1);
         if (var_name_length > 0) {
             char* var_name = strndup(start + 1, var_name_length);
-            char* var_value = getenv(var_name); // Get the value from the environment
+            char* var_value = special_variable(var_name);
+            if (var_value == NULL) var_value = (char *)var_get(var_name); // Get the value from the shell variables
             if (var_value) {
                 // Replace the variable in the string with its value
                 size_t expanded_input_length = strlen(expanded_input);
@@ -574,9 +1141,10 @@ char* expand_environment_variables(char* input) {
                 strncpy(new_expanded_input, expanded_input, start - expanded_input);
                 strcpy(new_expanded_input + (start - expanded_input), var_value);
                 strcpy(new_expanded_input + (start - expanded_input) + strlen(var_value), end);
+                size_t offset = start - expanded_input;
                 free(expanded_input);
                 expanded_input = new_expanded_input;
-                start = expanded_input + (start - expanded_input) + strlen(var_value); // Move past the replaced value
+                start = expanded_input + offset + strlen(var_value); // Move past the replaced value
             } else {
                 start = end; // Move past the variable name
             }
@@ -588,3 +1156,2397 @@ char* expand_environment_variables(char* input) {
     return expanded_input;
 }
 
+// Built-in 'set' command implementation
+void builtin_set(char **argv) {
+    if (argv[1] == NULL) {
+        printf("batch\t%s\n", opt_batch ? "on" : "off");
+        printf("failfast\t%s\n", opt_failfast ? "on" : "off");
+        printf("pipefail\t%s\n", opt_pipefail ? "on" : "off");
+        printf("record\t%s\n", record_fd >= 0 ? "on" : "off");
+        printf("trace\t%s\n", trace_enabled ? "on" : "off");
+        return;
+    }
+
+    for (int i = 1; argv[i] != NULL; i++) {
+        int enable;
+        if (strcmp(argv[i], "-o") == 0) {
+            enable = 1;
+        } else if (strcmp(argv[i], "+o") == 0) {
+            enable = 0;
+        } else {
+            fprintf(stderr, "set: %s: invalid option\n", argv[i]);
+            return;
+        }
+
+        if (argv[i + 1] == NULL) {
+            fprintf(stderr, "set: %s: option name required\n", argv[i]);
+            return;
+        }
+        i++;
+
+        if (strcmp(argv[i], "batch") == 0) {
+            opt_batch = enable;
+        } else if (strcmp(argv[i], "failfast") == 0) {
+            opt_failfast = enable;
+        } else if (strcmp(argv[i], "pipefail") == 0) {
+            opt_pipefail = enable;
+        } else if (strcmp(argv[i], "record") == 0) {
+            if (enable && record_fd < 0) {
+                char default_path[64];
+                const char *path = var_get("SHELL_RECORD");
+                if (path == NULL || *path == '\0') {
+                    snprintf(default_path, sizeof(default_path), "shell_record.%d.log", (int)getpid());
+                    path = default_path;
+                }
+                record_open(path);
+            } else if (!enable) {
+                record_close();
+            }
+        } else if (strcmp(argv[i], "trace") == 0) {
+            if (enable && !trace_enabled) {
+                char default_path[64];
+                const char *path = var_get("SHELL_TRACE");
+                if (path == NULL || *path == '\0') {
+                    snprintf(default_path, sizeof(default_path), "shell_trace.%d.json", (int)getpid());
+                    path = default_path;
+                }
+                trace_open(path);
+            } else if (!enable) {
+                trace_close();
+            }
+        } else {
+            fprintf(stderr, "set: %s: invalid option name\n", argv[i]);
+        }
+    }
+}
+
+// Functions to record the execution trace. Events are kept in a fixed ring
+// and written out in Chrome trace event format only when the ring fills up or
+// tracing stops, so the hot path is a clock read and a struct copy.
+void trace_open(const char *path) {
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (trace_fd < 0) {
+        perror("trace");
+        return;
+    }
+    // Viewers accept the array without its closing bracket, which lets us
+    // append events for as long as the shell runs.
+    if (write(trace_fd, "[\n", 2) != 2) {
+        perror("trace");
+    }
+    trace_count = 0;
+    trace_enabled = 1;
+}
+
+static void trace_flush(void) {
+    char buf[8192];
+    size_t len = 0;
+
+    for (int i = 0; i < trace_count; i++) {
+        struct trace_event *ev = &trace_ring[i];
+        if (len > sizeof(buf) - 256) {
+            if (write(trace_fd, buf, len) < 0) {
+                perror("trace");
+            }
+            len = 0;
+        }
+        len += snprintf(buf + len, sizeof(buf) - len,
+                        "{\"name\":\"%s\",\"cat\":\"shell\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,"
+                        "\"pid\":%d,\"tid\":%d,\"args\":{\"cmd\":%d,\"pid\":%d,\"argc\":%d}},\n",
+                        ev->name, ev->ts, ev->dur, (int)ev->pid, (int)ev->pid,
+                        ev->cmd_index, (int)ev->pid, ev->argc);
+    }
+    if (len > 0 && write(trace_fd, buf, len) < 0) {
+        perror("trace");
+    }
+    trace_count = 0;
+}
+
+void trace_close(void) {
+    if (!trace_enabled) {
+        return;
+    }
+    trace_flush();
+    close(trace_fd);
+    trace_fd = -1;
+    trace_enabled = 0;
+}
+
+// A forked child must never flush the events it inherited from the shell
+void trace_child_reset(void) {
+    trace_enabled = 0;
+    trace_count = 0;
+    trace_fd = -1;
+}
+
+long long trace_now(void) {
+    struct timespec ts;
+    if (!trace_enabled) {
+        return 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void trace_event(const char *name, long long start, int cmd_index, pid_t pid, char **argv) {
+    if (!trace_enabled) {
+        return;
+    }
+    struct trace_event *ev = &trace_ring[trace_count];
+    ev->name = name;
+    ev->ts = start;
+    ev->dur = trace_now() - start;
+    ev->cmd_index = cmd_index;
+    ev->pid = pid;
+    ev->argc = 0;
+    while (argv != NULL && argv[ev->argc] != NULL) {
+        ev->argc++;
+    }
+    if (++trace_count == TRACE_RING_SIZE) {
+        trace_flush();
+    }
+}
+
+// Prompt template engine. The template given to 'prompt' is compiled once into
+// segments, each of which caches its rendered text together with the
+// generation of the input it was computed from, so a redraw only recomputes
+// what actually changed.
+enum prompt_kind {
+    PROMPT_LITERAL,
+    PROMPT_CWD,      // \w
+    PROMPT_STATUS,   // \?
+    PROMPT_JOBS,     // \j
+    PROMPT_TIME,     // \t
+    PROMPT_GIT,      // \g
+    PROMPT_COMMAND   // $(...)
+};
+
+// How long a $(...) segment may hold up the prompt before it is left to
+// finish in the background and the previous value is shown instead
+#define PROMPT_COMMAND_TIMEOUT_MS 50
+
+struct prompt_segment {
+    enum prompt_kind kind;
+    char *text;          // literal text, or the command of a $(...) segment
+    char *cache;         // last rendered value
+    unsigned long stamp; // input generation the cache belongs to
+    pid_t pid;           // pending asynchronous refresh, if any
+    int fd;
+    char *pending;       // output collected so far from the refresh
+    size_t pending_len;
+};
+
+static struct prompt_segment *prompt_segments = NULL;
+static int prompt_nsegments = 0;
+static char *prompt_buffer = NULL;
+static size_t prompt_buffer_size = 0;
+
+// Git branch tracking shared by every \g segment
+static unsigned long git_generation = 1;
+static char *git_dir = NULL;
+static int git_inotify_fd = -1;
+static int git_watch = -1;
+
+static void prompt_add_segment(enum prompt_kind kind, const char *text, size_t len) {
+    prompt_segments = realloc(prompt_segments, (prompt_nsegments + 1) * sizeof(struct prompt_segment));
+    if (prompt_segments == NULL) {
+        perror("Unable to allocate memory for the prompt");
+        exit(EXIT_FAILURE);
+    }
+    struct prompt_segment *seg = &prompt_segments[prompt_nsegments++];
+    memset(seg, 0, sizeof(*seg));
+    seg->kind = kind;
+    seg->text = text != NULL ? strndup(text, len) : NULL;
+    seg->fd = -1;
+}
+
+static void prompt_free_segments(void) {
+    for (int i = 0; i < prompt_nsegments; i++) {
+        struct prompt_segment *seg = &prompt_segments[i];
+        if (seg->pid > 0) {
+            kill(seg->pid, SIGKILL);
+            waitpid(seg->pid, NULL, WNOHANG);
+        }
+        if (seg->fd >= 0) {
+            close(seg->fd);
+        }
+        free(seg->text);
+        free(seg->cache);
+        free(seg->pending);
+    }
+    free(prompt_segments);
+    prompt_segments = NULL;
+    prompt_nsegments = 0;
+}
+
+// Function to compile a prompt template into segments
+void prompt_compile(const char *template) {
+    const char *p = template;
+    const char *lit = template;
+
+    prompt_free_segments();
+
+    while (*p != '\0') {
+        enum prompt_kind kind = PROMPT_LITERAL;
+        const char *next = p + 2;
+
+        if (p[0] == '\\' && p[1] != '\0') {
+            switch (p[1]) {
+                case 'w': kind = PROMPT_CWD; break;
+                case '?': kind = PROMPT_STATUS; break;
+                case 'j': kind = PROMPT_JOBS; break;
+                case 't': kind = PROMPT_TIME; break;
+                case 'g': kind = PROMPT_GIT; break;
+                case '\\':
+                case '$':
+                    // Escaped character, keep the second one as literal text
+                    if (p > lit) {
+                        prompt_add_segment(PROMPT_LITERAL, lit, p - lit);
+                    }
+                    lit = p + 1;
+                    p += 2;
+                    continue;
+                default: break;
+            }
+        } else if (p[0] == '$' && p[1] == '(') {
+            const char *close_paren = strchr(p + 2, ')');
+            if (close_paren != NULL) {
+                kind = PROMPT_COMMAND;
+                next = close_paren + 1;
+            }
+        }
+
+        if (kind == PROMPT_LITERAL) {
+            p++;
+            continue;
+        }
+        if (p > lit) {
+            prompt_add_segment(PROMPT_LITERAL, lit, p - lit);
+        }
+        if (kind == PROMPT_COMMAND) {
+            prompt_add_segment(kind, p + 2, next - p - 3);
+        } else {
+            prompt_add_segment(kind, NULL, 0);
+        }
+        p = next;
+        lit = next;
+    }
+    if (p > lit) {
+        prompt_add_segment(PROMPT_LITERAL, lit, p - lit);
+    }
+}
+
+// Function to find the .git directory above the current directory and watch
+// it, so a checkout from another terminal refreshes the branch segment
+static void git_locate(void) {
+    char *dir = getcwd(NULL, 0);
+
+    free(git_dir);
+    git_dir = NULL;
+#ifdef __linux__
+    if (git_watch >= 0) {
+        inotify_rm_watch(git_inotify_fd, git_watch);
+        git_watch = -1;
+    }
+#endif
+    if (dir == NULL) {
+        return;
+    }
+
+    while (1) {
+        char *candidate = malloc(strlen(dir) + 6);
+        sprintf(candidate, "%s/.git", dir);
+        if (access(candidate, F_OK) == 0) {
+            git_dir = candidate;
+            break;
+        }
+        free(candidate);
+
+        char *slash = strrchr(dir, '/');
+        if (slash == NULL || slash == dir) {
+            break;
+        }
+        *slash = '\0';
+    }
+    free(dir);
+
+#ifdef __linux__
+    if (git_dir != NULL) {
+        if (git_inotify_fd < 0) {
+            git_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        }
+        if (git_inotify_fd >= 0) {
+            // git replaces HEAD by renaming HEAD.lock over it
+            git_watch = inotify_add_watch(git_inotify_fd, git_dir, IN_MOVED_TO | IN_CLOSE_WRITE | IN_CREATE);
+        }
+    }
+#endif
+}
+
+// Function to check whether HEAD changed since the branch was last read
+static void git_poll(void) {
+#ifdef __linux__
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+
+    if (git_inotify_fd < 0) {
+        return;
+    }
+    while ((len = read(git_inotify_fd, buf, sizeof(buf))) > 0) {
+        for (char *ptr = buf; ptr < buf + len;) {
+            struct inotify_event *ev = (struct inotify_event *)ptr;
+            if (ev->len > 0 && strcmp(ev->name, "HEAD") == 0) {
+                git_generation++;
+            }
+            ptr += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+#endif
+}
+
+static char *git_branch(void) {
+    char path[4096];
+    char head[256];
+    FILE *fp;
+
+    if (git_dir == NULL) {
+        return strdup("");
+    }
+    snprintf(path, sizeof(path), "%s/HEAD", git_dir);
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        return strdup("");
+    }
+    if (fgets(head, sizeof(head), fp) == NULL) {
+        head[0] = '\0';
+    }
+    fclose(fp);
+    head[strcspn(head, "\n")] = '\0';
+
+    if (strncmp(head, "ref: refs/heads/", 16) == 0) {
+        return strdup(head + 16);
+    }
+    // Detached HEAD, show the abbreviated commit
+    return strndup(head, 7);
+}
+
+// Function to start a $(...) segment in a child of the shell, which runs the
+// command through the regular parser with its output going to a pipe
+static void prompt_command_start(struct prompt_segment *seg) {
+    int fds[2];
+
+    if (pipe(fds) == -1) {
+        perror("pipe");
+        return;
+    }
+    fflush(stdout);
+    seg->pid = fork();
+    if (seg->pid == -1) {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        seg->pid = 0;
+        return;
+    }
+    if (seg->pid == 0) {
+        trace_child_reset();
+        record_child_reset();
+        close(fds[0]);
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[1]);
+
+        char *cmd = strdup(seg->text);
+        command **cmd_line = process_cmd_line(cmd, 1);
+        executeCommand(cmd_line);
+        exit(last_status);
+    }
+    close(fds[1]);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    seg->fd = fds[0];
+    seg->pending_len = 0;
+}
+
+// Function to collect output of a pending $(...) segment, waiting at most
+// timeout_ms; returns 1 once the command has finished
+static int prompt_command_collect(struct prompt_segment *seg, int timeout_ms) {
+    struct pollfd pfd = { .fd = seg->fd, .events = POLLIN };
+    struct timespec now;
+    char buf[512];
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long deadline = (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000 + timeout_ms;
+
+    while (1) {
+        ssize_t n = read(seg->fd, buf, sizeof(buf));
+        if (n > 0) {
+            seg->pending = realloc(seg->pending, seg->pending_len + n + 1);
+            memcpy(seg->pending + seg->pending_len, buf, n);
+            seg->pending_len += n;
+            continue;
+        }
+        if (n == 0) {
+            break;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN) {
+            return 0;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        timeout_ms = (int)(deadline - ((long long)now.tv_sec * 1000 + now.tv_nsec / 1000000));
+        if (timeout_ms <= 0 || poll(&pfd, 1, timeout_ms) <= 0) {
+            return 0;
+        }
+    }
+
+    close(seg->fd);
+    seg->fd = -1;
+    waitpid(seg->pid, NULL, WNOHANG);
+    seg->pid = 0;
+
+    // Like command substitution, drop trailing newlines
+    while (seg->pending_len > 0 && seg->pending[seg->pending_len - 1] == '\n') {
+        seg->pending_len--;
+    }
+    free(seg->cache);
+    seg->cache = strndup(seg->pending != NULL ? seg->pending : "", seg->pending_len);
+    return 1;
+}
+
+static void prompt_refresh(struct prompt_segment *seg) {
+    static unsigned long git_located = 0;
+    char buf[64];
+    unsigned long stamp;
+
+    switch (seg->kind) {
+        case PROMPT_LITERAL:
+            return;
+        case PROMPT_CWD: {
+            if (seg->stamp == cwd_generation) {
+                return;
+            }
+            char *cwd = shell_cwd != NULL ? strdup(shell_cwd) : NULL;
+            const char *home = var_get("HOME");
+            free(seg->cache);
+            if (cwd == NULL) {
+                seg->cache = strdup("?");
+            } else if (home != NULL && *home != '\0' && strncmp(cwd, home, strlen(home)) == 0
+                       && (cwd[strlen(home)] == '/' || cwd[strlen(home)] == '\0')) {
+                seg->cache = malloc(strlen(cwd) - strlen(home) + 2);
+                sprintf(seg->cache, "~%s", cwd + strlen(home));
+            } else {
+                seg->cache = strdup(cwd);
+            }
+            free(cwd);
+            seg->stamp = cwd_generation;
+            return;
+        }
+        case PROMPT_STATUS:
+            if (seg->stamp == status_generation) {
+                return;
+            }
+            snprintf(buf, sizeof(buf), "%d", last_status);
+            free(seg->cache);
+            seg->cache = strdup(buf);
+            seg->stamp = status_generation;
+            return;
+        case PROMPT_JOBS:
+            stamp = job_generation;
+            if (seg->stamp == stamp) {
+                return;
+            }
+            snprintf(buf, sizeof(buf), "%d", (int)job_count);
+            free(seg->cache);
+            seg->cache = strdup(buf);
+            seg->stamp = stamp;
+            return;
+        case PROMPT_TIME: {
+            time_t now = time(NULL);
+            if (seg->cache != NULL && seg->stamp == (unsigned long)now) {
+                return;
+            }
+            strftime(buf, sizeof(buf), "%H:%M:%S", localtime(&now));
+            free(seg->cache);
+            seg->cache = strdup(buf);
+            seg->stamp = (unsigned long)now;
+            return;
+        }
+        case PROMPT_GIT:
+            if (git_located != cwd_generation) {
+                git_locate();
+                git_located = cwd_generation;
+                git_generation++;
+            }
+            git_poll();
+            if (seg->stamp == git_generation) {
+                return;
+            }
+            free(seg->cache);
+            seg->cache = git_branch();
+            seg->stamp = git_generation;
+            return;
+        case PROMPT_COMMAND:
+            if (seg->pid > 0 && !prompt_command_collect(seg, 0)) {
+                // A slow refresh is still running, keep showing the old value
+                return;
+            }
+            if (seg->stamp == line_generation) {
+                return;
+            }
+            seg->stamp = line_generation;
+            prompt_command_start(seg);
+            if (seg->pid > 0) {
+                prompt_command_collect(seg, PROMPT_COMMAND_TIMEOUT_MS);
+            }
+            return;
+    }
+}
+
+// Function to render the compiled prompt, recomputing only stale segments
+const char *prompt_render(void) {
+    size_t len = 0;
+
+    for (int i = 0; i < prompt_nsegments; i++) {
+        struct prompt_segment *seg = &prompt_segments[i];
+        const char *text;
+
+        prompt_refresh(seg);
+        text = seg->kind == PROMPT_LITERAL ? seg->text : seg->cache;
+        if (text == NULL) {
+            continue;
+        }
+
+        size_t text_len = strlen(text);
+        if (len + text_len + 1 > prompt_buffer_size) {
+            prompt_buffer_size = (len + text_len + 1) * 2;
+            prompt_buffer = realloc(prompt_buffer, prompt_buffer_size);
+            if (prompt_buffer == NULL) {
+                perror("Unable to allocate memory for the prompt");
+                exit(EXIT_FAILURE);
+            }
+        }
+        memcpy(prompt_buffer + len, text, text_len);
+        len += text_len;
+    }
+
+    if (prompt_buffer == NULL) {
+        return "";
+    }
+    prompt_buffer[len] = '\0';
+    return prompt_buffer;
+}
+
+#ifndef USE_LINEEDIT
+// Tab completion. Command names are served from a sorted index of every
+// executable on PATH; the index is built on a background thread and swapped
+// in whole, so a keypress only costs a binary search.
+struct exec_index {
+    char **names;
+    size_t count;
+    char *path;       // PATH the index was built from
+    time_t *mtimes;   // modification time of each PATH directory
+    int ndirs;
+};
+
+static const char *builtin_names[] = { "cd", "exit", "export", "history", "prompt", "pwd", "set", "unset", NULL };
+
+static struct exec_index *exec_index = NULL;
+static pthread_mutex_t exec_index_lock = PTHREAD_MUTEX_INITIALIZER;
+static int exec_index_building = 0;
+static time_t exec_index_checked = 0;
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static void exec_index_free(struct exec_index *idx) {
+    if (idx == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < idx->count; i++) {
+        free(idx->names[i]);
+    }
+    free(idx->names);
+    free(idx->path);
+    free(idx->mtimes);
+    free(idx);
+}
+
+static void *exec_index_build(void *arg) {
+    struct exec_index *idx = calloc(1, sizeof(struct exec_index));
+    size_t alloc = 0;
+    char *path = arg;
+    char *saveptr = NULL;
+    char *copy = strdup(path);
+
+    idx->path = path;
+    for (char *dir = strtok_r(copy, ":", &saveptr); dir != NULL; dir = strtok_r(NULL, ":", &saveptr)) {
+        struct stat st;
+        DIR *dp;
+        struct dirent *de;
+
+        idx->mtimes = realloc(idx->mtimes, (idx->ndirs + 1) * sizeof(time_t));
+        idx->mtimes[idx->ndirs++] = stat(dir, &st) == 0 ? st.st_mtime : 0;
+
+        if ((dp = opendir(dir)) == NULL) {
+            continue;
+        }
+        while ((de = readdir(dp)) != NULL) {
+            if (de->d_name[0] == '.' || de->d_type == DT_DIR) {
+                continue;
+            }
+            if (faccessat(dirfd(dp), de->d_name, X_OK, 0) != 0) {
+                continue;
+            }
+            if (idx->count == alloc) {
+                alloc = alloc ? alloc * 2 : 1024;
+                idx->names = realloc(idx->names, alloc * sizeof(char *));
+            }
+            idx->names[idx->count++] = strdup(de->d_name);
+        }
+        closedir(dp);
+    }
+    free(copy);
+
+    // Sort and drop names shadowed by an earlier PATH entry
+    qsort(idx->names, idx->count, sizeof(char *), compare_names);
+    size_t unique = 0;
+    for (size_t i = 0; i < idx->count; i++) {
+        if (unique > 0 && strcmp(idx->names[unique - 1], idx->names[i]) == 0) {
+            free(idx->names[i]);
+            continue;
+        }
+        idx->names[unique++] = idx->names[i];
+    }
+    idx->count = unique;
+
+    pthread_mutex_lock(&exec_index_lock);
+    struct exec_index *old = exec_index;
+    exec_index = idx;
+    exec_index_building = 0;
+    pthread_mutex_unlock(&exec_index_lock);
+
+    exec_index_free(old);
+    return NULL;
+}
+
+// Function to start a rebuild of the executable index unless one is running
+static void exec_index_refresh(void) {
+    const char *path = var_get("PATH");
+    pthread_t thread;
+    pthread_attr_t attr;
+
+    pthread_mutex_lock(&exec_index_lock);
+    if (exec_index_building) {
+        pthread_mutex_unlock(&exec_index_lock);
+        return;
+    }
+    exec_index_building = 1;
+    pthread_mutex_unlock(&exec_index_lock);
+
+    // The environment is not thread safe, so the thread gets its own copy
+    char *path_copy = strdup(path != NULL ? path : "/usr/bin:/bin");
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    // Signals are for the main thread only; in particular a SIGCHLD handled
+    // here could reap a child the main thread is waiting for
+    sigset_t all_signals, old_mask;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_SETMASK, &all_signals, &old_mask);
+    int failed = pthread_create(&thread, &attr, exec_index_build, path_copy) != 0;
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    if (failed) {
+        free(path_copy);
+        pthread_mutex_lock(&exec_index_lock);
+        exec_index_building = 0;
+        pthread_mutex_unlock(&exec_index_lock);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+// Function to rebuild the index when PATH or one of its directories changed.
+// Directories are stat'ed at most once a second.
+static void exec_index_check(void) {
+    time_t now = time(NULL);
+    const char *path = var_get("PATH");
+    int stale = 0;
+
+    if (now == exec_index_checked) {
+        return;
+    }
+    exec_index_checked = now;
+
+    pthread_mutex_lock(&exec_index_lock);
+    if (exec_index == NULL) {
+        pthread_mutex_unlock(&exec_index_lock);
+        return;
+    }
+    if (path == NULL || strcmp(path, exec_index->path) != 0) {
+        stale = 1;
+    } else {
+        char *copy = strdup(path);
+        char *saveptr = NULL;
+        int i = 0;
+        for (char *dir = strtok_r(copy, ":", &saveptr); dir != NULL && !stale; dir = strtok_r(NULL, ":", &saveptr)) {
+            struct stat st;
+            time_t mtime = stat(dir, &st) == 0 ? st.st_mtime : 0;
+            stale = i >= exec_index->ndirs || exec_index->mtimes[i] != mtime;
+            i++;
+        }
+        free(copy);
+    }
+    pthread_mutex_unlock(&exec_index_lock);
+
+    if (stale) {
+        exec_index_refresh();
+    }
+}
+
+static char *command_generator(const char *text, int state) {
+    static char **matches = NULL;
+    static size_t nmatches = 0;
+    static size_t next = 0;
+
+    if (state == 0) {
+        size_t len = strlen(text);
+
+        free(matches);
+        matches = NULL;
+        nmatches = next = 0;
+
+        for (int i = 0; builtin_names[i] != NULL; i++) {
+            if (strncmp(builtin_names[i], text, len) == 0) {
+                matches = realloc(matches, (nmatches + 1) * sizeof(char *));
+                matches[nmatches++] = strdup(builtin_names[i]);
+            }
+        }
+
+        pthread_mutex_lock(&exec_index_lock);
+        if (exec_index != NULL) {
+            // Binary search for the first name not sorting before the prefix
+            size_t lo = 0, hi = exec_index->count;
+            while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+                if (strcmp(exec_index->names[mid], text) < 0) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+            size_t end = lo;
+            while (end < exec_index->count && strncmp(exec_index->names[end], text, len) == 0) {
+                end++;
+            }
+            matches = realloc(matches, (nmatches + end - lo + 1) * sizeof(char *));
+            for (size_t i = lo; i < end; i++) {
+                matches[nmatches++] = strdup(exec_index->names[i]);
+            }
+        }
+        pthread_mutex_unlock(&exec_index_lock);
+    }
+
+    if (next < nmatches) {
+        return matches[next++];
+    }
+    return NULL;
+}
+
+// Command name of the simple command the cursor is in, taken from the line
+static char *completion_command = NULL;
+
+static char *argument_generator(const char *text, int state) {
+    static int offset;
+    static char *line_copy = NULL;
+    static char *saveptr;
+    size_t len = strlen(text);
+
+    if (state == 0) {
+        offset = 0;
+        free(line_copy);
+        line_copy = NULL;
+    }
+
+    // Offer words previously typed as arguments of the same command, most
+    // recent history entries first
+    while (1) {
+        if (line_copy == NULL) {
+            HIST_ENTRY *entry = history_get(history_base + history_length - 1 - offset);
+            offset++;
+            if (offset > history_length) {
+                return NULL;
+            }
+            if (entry == NULL || entry->line == NULL) {
+                continue;
+            }
+            line_copy = strdup(entry->line);
+            char *word = strtok_r(line_copy, " \t|;&<>", &saveptr);
+            if (word == NULL || strcmp(word, completion_command) != 0) {
+                free(line_copy);
+                line_copy = NULL;
+                continue;
+            }
+        }
+
+        char *word;
+        while ((word = strtok_r(NULL, " \t|;&<>", &saveptr)) != NULL) {
+            if (strncmp(word, text, len) == 0) {
+                return strdup(word);
+            }
+        }
+        free(line_copy);
+        line_copy = NULL;
+    }
+}
+
+static char **shell_completion(const char *text, int start, int end) {
+    (void)end;
+    int pos = start;
+
+    // Command position is the start of the line or right after | ; &
+    while (pos > 0 && (rl_line_buffer[pos - 1] == ' ' || rl_line_buffer[pos - 1] == '\t')) {
+        pos--;
+    }
+    if (pos == 0 || strchr("|;&", rl_line_buffer[pos - 1]) != NULL) {
+        exec_index_check();
+        rl_attempted_completion_over = 1;
+        return rl_completion_matches(text, command_generator);
+    }
+
+    // Find the command word of this simple command
+    while (pos > 0 && strchr("|;&", rl_line_buffer[pos - 1]) == NULL) {
+        pos--;
+    }
+    while (rl_line_buffer[pos] == ' ' || rl_line_buffer[pos] == '\t') {
+        pos++;
+    }
+    free(completion_command);
+    completion_command = strndup(rl_line_buffer + pos, strcspn(rl_line_buffer + pos, " \t"));
+
+    // Falls back to filename completion when history has nothing to offer
+    return rl_completion_matches(text, argument_generator);
+}
+
+// Function to install tab completion and start indexing PATH
+void completion_init(void) {
+    rl_attempted_completion_function = shell_completion;
+    // Scripts and piped input never ask for completions, so do not pay
+    // for the PATH scan there
+    if (isatty(STDIN_FILENO)) {
+        exec_index_refresh();
+    }
+}
+#else
+// The built-in line editor has no completion
+void completion_init(void) {
+}
+#endif
+
+// Execution prefixes. 'pin', 'nice' and 'limit' in front of a command are
+// applied by the child itself between fork and exec, so placing a command or
+// a single pipeline stage costs no extra process.
+
+// Function to parse a CPU list such as "0-3,6" into an affinity mask
+static int parse_cpu_list(const char *list, cpu_set_t *set) {
+    const char *p = list;
+
+    CPU_ZERO(set);
+    while (*p != '\0') {
+        char *end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p || first < 0) {
+            return -1;
+        }
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first) {
+                return -1;
+            }
+        }
+        if (last >= CPU_SETSIZE) {
+            return -1;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        if (*end == ',') {
+            end++;
+        } else if (*end != '\0') {
+            return -1;
+        }
+        p = end;
+    }
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+// Function to parse a limit value with an optional unit suffix; sizes take
+// K/M/G/T, times take s/m/h, and "unlimited" lifts the limit
+static int parse_limit_value(const char *value, int is_time, rlim_t *out) {
+    char *end;
+    unsigned long long n;
+
+    if (strcmp(value, "unlimited") == 0) {
+        *out = RLIM_INFINITY;
+        return 0;
+    }
+    n = strtoull(value, &end, 10);
+    if (end == value) {
+        return -1;
+    }
+    if (is_time) {
+        switch (*end) {
+            case '\0': case 's': break;
+            case 'm': n *= 60; break;
+            case 'h': n *= 3600; break;
+            default: return -1;
+        }
+    } else {
+        switch (*end) {
+            case '\0': break;
+            case 'K': case 'k': n <<= 10; break;
+            case 'M': case 'm': n <<= 20; break;
+            case 'G': case 'g': n <<= 30; break;
+            case 'T': case 't': n <<= 40; break;
+            default: return -1;
+        }
+    }
+    if (*end != '\0' && end[1] != '\0') {
+        return -1;
+    }
+    *out = (rlim_t)n;
+    return 0;
+}
+
+static int apply_limit(const char *spec) {
+    static const struct {
+        const char *name;
+        int resource;
+        int is_time;
+    } limits[] = {
+        { "mem", RLIMIT_AS, 0 },
+        { "cpu", RLIMIT_CPU, 1 },
+        { "files", RLIMIT_NOFILE, 0 },
+        { "procs", RLIMIT_NPROC, 0 },
+        { "stack", RLIMIT_STACK, 0 },
+        { "core", RLIMIT_CORE, 0 },
+        { "fsize", RLIMIT_FSIZE, 0 },
+        { NULL, 0, 0 }
+    };
+    const char *eq = strchr(spec, '=');
+
+    for (int i = 0; limits[i].name != NULL; i++) {
+        if (strlen(limits[i].name) != (size_t)(eq - spec) || strncmp(spec, limits[i].name, eq - spec) != 0) {
+            continue;
+        }
+        struct rlimit rl;
+        rlim_t value;
+        if (parse_limit_value(eq + 1, limits[i].is_time, &value) == -1) {
+            fprintf(stderr, "limit: %s: invalid value\n", spec);
+            return -1;
+        }
+        getrlimit(limits[i].resource, &rl);
+        // Only root may raise the hard limit, and running the command with
+        // a different limit than asked for would be worse than not at all
+        if (rl.rlim_max != RLIM_INFINITY && (value == RLIM_INFINITY || value > rl.rlim_max)) {
+            fprintf(stderr, "limit: %s: above the hard limit of %llu\n", spec, (unsigned long long)rl.rlim_max);
+            return -1;
+        }
+        rl.rlim_cur = value;
+        if (setrlimit(limits[i].resource, &rl) == -1) {
+            perror("limit");
+            return -1;
+        }
+        return 0;
+    }
+    fprintf(stderr, "limit: %.*s: unknown resource\n", (int)(eq - spec), spec);
+    return -1;
+}
+
+// Function to apply and strip leading execution prefixes from a command.
+// Called in the child only; returns -1 if a prefix is malformed.
+int apply_exec_prefixes(command *cmd) {
+    char **argv = cmd->argv;
+    int assigned = 0;
+
+    while (argv[0] != NULL) {
+        if (is_assignment(argv[0])) {
+            // VAR=value in front of a command only goes to its environment
+            char *eq = strchr(argv[0], '=');
+            *eq = '\0';
+            var_set(argv[0], eq + 1, 1);
+            *eq = '=';
+            assigned = 1;
+            argv++;
+        } else if (strcmp(argv[0], "pin") == 0) {
+            cpu_set_t set;
+            if (argv[1] == NULL || parse_cpu_list(argv[1], &set) == -1) {
+                fprintf(stderr, "pin: usage: pin CPULIST command\n");
+                return -1;
+            }
+            if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+                perror("pin");
+                return -1;
+            }
+            argv += 2;
+        } else if (strcmp(argv[0], "nice") == 0) {
+            int adjustment = 10;
+            int skip = 1;
+            char *end;
+            if (argv[1] != NULL && strcmp(argv[1], "-n") == 0 && argv[2] != NULL) {
+                adjustment = (int)strtol(argv[2], &end, 10);
+                skip = *end == '\0' ? 3 : -1;
+            } else if (argv[1] != NULL && argv[1][0] == '-' && isdigit((unsigned char)argv[1][1])) {
+                // The old -N form, as nice(1) still accepts; a bare number
+                // is the command to run
+                adjustment = (int)strtol(argv[1] + 1, &end, 10);
+                skip = *end == '\0' ? 2 : -1;
+            }
+            if (skip == -1) {
+                fprintf(stderr, "nice: usage: nice [-n N | -N] command\n");
+                return -1;
+            }
+            errno = 0;
+            if (nice(adjustment) == -1 && errno != 0) {
+                perror("nice");
+                return -1;
+            }
+            argv += skip;
+        } else if (strcmp(argv[0], "limit") == 0) {
+            int n = 1;
+            while (argv[n] != NULL && strchr(argv[n], '=') != NULL) {
+                if (apply_limit(argv[n]) == -1) {
+                    return -1;
+                }
+                n++;
+            }
+            if (n == 1) {
+                fprintf(stderr, "limit: usage: limit resource=value... command\n");
+                return -1;
+            }
+            argv += n;
+        } else {
+            break;
+        }
+    }
+
+    if (assigned) {
+        var_sync_environ();
+    }
+    if (argv == cmd->argv) {
+        return 0;
+    }
+    if (argv[0] == NULL) {
+        fprintf(stderr, "%s: command required\n", cmd->com_name);
+        return -1;
+    }
+    // Shift the real command down; the child execs or exits right after,
+    // so the skipped words are not worth freeing
+    int n = 0;
+    while (argv[n] != NULL) {
+        cmd->argv[n] = argv[n];
+        n++;
+    }
+    cmd->argv[n] = NULL;
+    cmd->com_name = cmd->argv[0];
+    return 0;
+}
+
+// ARG_MAX-aware batching. A command whose expanded argument list does not
+// fit in a single exec is split into the largest chunks that do, and the
+// chunks are run one after another or up to N at a time, like xargs.
+// The batch slots live on the stack, so N is capped.
+#define EACH_MAX_PARALLEL 256
+
+// Function to strip a leading 'each [-P N]' from a command. Returns 1 if it
+// was present, 0 if not and -1 on a usage error.
+int strip_each_prefix(command *cmd, int *parallel) {
+    int skip = 1;
+
+    if (cmd->argv[0] == NULL || strcmp(cmd->argv[0], "each") != 0) {
+        return 0;
+    }
+    if (cmd->argv[1] != NULL && strcmp(cmd->argv[1], "-P") == 0) {
+        char *end;
+        long n = cmd->argv[2] != NULL ? strtol(cmd->argv[2], &end, 10) : 0;
+        if (cmd->argv[2] == NULL || *end != '\0' || n < 1) {
+            fprintf(stderr, "each: usage: each [-P N] command\n");
+            return -1;
+        }
+        if (n > EACH_MAX_PARALLEL) {
+            fprintf(stderr, "each: -P %s: at most %d batches can run at once\n", cmd->argv[2], EACH_MAX_PARALLEL);
+            return -1;
+        }
+        *parallel = (int)n;
+        skip = 3;
+    }
+    if (cmd->argv[skip] == NULL) {
+        fprintf(stderr, "each: usage: each [-P N] command\n");
+        return -1;
+    }
+
+    for (int i = 0; i < skip; i++) {
+        free(cmd->argv[i]);
+    }
+    int n = 0;
+    while (cmd->argv[n + skip] != NULL) {
+        cmd->argv[n] = cmd->argv[n + skip];
+        n++;
+    }
+    cmd->argv[n] = NULL;
+    free(cmd->com_name);
+    cmd->com_name = strdup(cmd->argv[0]);
+    return 1;
+}
+
+// Function to count the words of an argument vector
+int argv_count(char **argv) {
+    int n = 0;
+    while (argv[n] != NULL) {
+        n++;
+    }
+    return n;
+}
+
+// Function to compute the bytes an argument vector takes up in exec
+size_t argv_size(char **argv) {
+    size_t size = 0;
+    for (int i = 0; argv[i] != NULL; i++) {
+        size += strlen(argv[i]) + 1 + sizeof(char *);
+    }
+    return size + sizeof(char *);
+}
+
+// Function to compute how many bytes of arguments one exec may carry
+size_t arg_limit(void) {
+    extern char **environ;
+    long arg_max = sysconf(_SC_ARG_MAX);
+    size_t env_size = argv_size(environ);
+
+    if (arg_max <= 0) {
+        arg_max = 131072;
+    }
+    // Keep the same headroom xargs leaves for the exec itself
+    if ((size_t)arg_max < env_size + 4096) {
+        return 2048;
+    }
+    return (size_t)arg_max - env_size - 2048;
+}
+
+// Function to run a command in batches. The words a wildcard produced
+// (flagged in from_glob) are spread over the batches; every other word,
+// including prefixes such as 'nice' or VAR=value, the command name, its
+// options and operands such as a grep pattern or a cp destination, is
+// repeated in each batch in its original place. Wildcard words from more
+// than one pattern are pooled at the place of the first.
+void run_batched(command *cmd, int parallel, const char *from_glob) {
+    char **argv = cmd->argv;
+    int argc = argv_count(argv);
+    size_t limit = arg_limit();
+    size_t fixed_size = sizeof(char *);
+    pid_t slots[parallel];
+    long long fork_ts[parallel];
+    int running = 0;
+    int status_code = 0;
+
+    // A backgrounded run is driven by a child of its own so the shell can
+    // go back to the prompt; SIGCHLD is held until the job is registered
+    if (cmd->background) {
+        sigset_t chld_mask, old_mask;
+        sigemptyset(&chld_mask);
+        sigaddset(&chld_mask, SIGCHLD);
+        sigprocmask(SIG_BLOCK, &chld_mask, &old_mask);
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("fork");
+            sigprocmask(SIG_SETMASK, &old_mask, NULL);
+            set_last_status(1);
+            return;
+        }
+        if (pid == 0) {
+            trace_child_reset();
+            record_child_reset();
+            sigprocmask(SIG_SETMASK, &old_mask, NULL);
+            cmd->background = 0;
+            run_batched(cmd, parallel, from_glob);
+            exit(last_status);
+        }
+        add_job(pid);
+        printf("[Started background job with PID %d]\n", pid);
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
+        return;
+    }
+
+    // Split the words into the fixed ones and the pool to batch
+    char **fixed = malloc((argc + 1) * sizeof(char *));
+    char **pool = malloc((argc + 1) * sizeof(char *));
+    char **chunk = malloc((argc + 1) * sizeof(char *));
+    if (fixed == NULL || pool == NULL || chunk == NULL) {
+        perror("Unable to allocate memory for a batch");
+        free(fixed);
+        free(pool);
+        free(chunk);
+        return;
+    }
+    int nfixed = 0, npool = 0, insert_at = -1;
+    for (int i = 0; i < argc; i++) {
+        if (from_glob[i]) {
+            if (insert_at == -1) {
+                insert_at = nfixed;
+            }
+            pool[npool++] = argv[i];
+        } else {
+            fixed[nfixed++] = argv[i];
+            fixed_size += strlen(argv[i]) + 1 + sizeof(char *);
+        }
+    }
+
+    // Output files are truncated once here and appended to by every batch
+    if (cmd->redirect_out != NULL) {
+        int fd = open(cmd->redirect_out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    if (cmd->redirect_err != NULL) {
+        int fd = open(cmd->redirect_err, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    for (int i = 0; i < parallel; i++) {
+        slots[i] = 0;
+    }
+
+    // SIGCHLD stays blocked while wait_any_child consumes it, so the reaper
+    // cannot take our batches from us
+    sigset_t chld_mask, old_mask;
+    sigemptyset(&chld_mask);
+    sigaddset(&chld_mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld_mask, &old_mask);
+
+    int next = 0;
+    while (next < npool || running > 0) {
+        if (next < npool && running < parallel) {
+            int n = insert_at;
+            size_t size = fixed_size;
+
+            // Always take at least one argument so an oversized one still
+            // gets its own exec and its own error
+            memcpy(chunk, fixed, insert_at * sizeof(char *));
+            while (next < npool) {
+                size_t cost = strlen(pool[next]) + 1 + sizeof(char *);
+                if (n > insert_at && size + cost > limit) {
+                    break;
+                }
+                chunk[n++] = pool[next++];
+                size += cost;
+            }
+            memcpy(chunk + n, fixed + insert_at, (nfixed - insert_at) * sizeof(char *));
+            chunk[n + nfixed - insert_at] = NULL;
+
+            int slot = 0;
+            while (slots[slot] != 0) {
+                slot++;
+            }
+            fork_ts[slot] = trace_now();
+            fflush(stdout);
+            pid_t pid = fork();
+            if (pid == -1) {
+                perror("fork");
+                status_code = 1;
+                break;
+            }
+            if (pid == 0) {
+                trace_child_reset();
+                record_child_reset();
+                sigprocmask(SIG_SETMASK, &old_mask, NULL);
+                cmd->argv = chunk;
+                exec_child(cmd, 1);
+            }
+            trace_event("fork", fork_ts[slot], trace_cmd_index, getpid(), chunk);
+            slots[slot] = pid;
+            running++;
+            continue;
+        }
+
+        // Wait for any batch to finish before starting the next one
+        int status;
+        int done = wait_any_child(slots, parallel, &status);
+        if (done == -1) {
+            break;
+        }
+        trace_event("exec", fork_ts[done], trace_cmd_index, slots[done], NULL);
+        if (decode_status(status) != 0) {
+            status_code = decode_status(status);
+        }
+        slots[done] = 0;
+        running--;
+    }
+
+    // Anything still running after an error is waited for normally
+    for (int i = 0; i < parallel; i++) {
+        if (slots[i] != 0) {
+            wait_for_child(slots[i]);
+        }
+    }
+    // We may have swallowed the SIGCHLD of a background job
+    sigchld_handler(SIGCHLD);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+
+    free(fixed);
+    free(pool);
+    free(chunk);
+    set_last_status(status_code);
+}
+
+// Frecency database for 'cd -j'. Visited directories live in a fixed-size
+// file mapped into memory, so recording a visit is a handful of stores and a
+// jump is one scan of at most CD_DB_ENTRIES records, with no directory walk.
+#define CD_DB_ENTRIES 1024
+#define CD_DB_PATH_MAX 240
+#define CD_DB_MAGIC "SHCDDB1"
+// Once the ranks add up to this much they are all aged, as z does
+#define CD_DB_MAX_RANK 9000.0
+
+struct cd_entry {
+    double rank;
+    long long last;   // time of the last visit
+    char path[CD_DB_PATH_MAX];
+};
+
+struct cd_db {
+    char magic[8];
+    unsigned int count;
+    unsigned int unused;
+    struct cd_entry entries[CD_DB_ENTRIES];
+};
+
+static struct cd_db *cd_db = NULL;
+static int cd_db_fd = -1;
+static int cd_db_failed = 0;
+
+// Other shells map the same file, so every update and scan holds an
+// exclusive lock on it; the lock is advisory and only orders the shells
+static void cd_db_lock(void) {
+    while (flock(cd_db_fd, LOCK_EX) == -1 && errno == EINTR) {
+    }
+}
+
+static void cd_db_unlock(void) {
+    flock(cd_db_fd, LOCK_UN);
+}
+
+static struct cd_db *cd_db_open(void) {
+    char path[4096];
+    const char *file = var_get("SHELL_CD_DB");
+    int fd;
+
+    if (cd_db != NULL || cd_db_failed) {
+        return cd_db;
+    }
+    cd_db_failed = 1;
+
+    if (file == NULL || *file == '\0') {
+        const char *home = var_get("HOME");
+        if (home == NULL) {
+            return NULL;
+        }
+        snprintf(path, sizeof(path), "%s/.shell_cd.db", home);
+        file = path;
+    }
+    if ((fd = open(file, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0) {
+        return NULL;
+    }
+    if (ftruncate(fd, sizeof(struct cd_db)) == -1) {
+        close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, sizeof(struct cd_db), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+
+    // The descriptor is kept open for flock
+    cd_db = map;
+    cd_db_fd = fd;
+    cd_db_lock();
+    if (memcmp(cd_db->magic, CD_DB_MAGIC, sizeof(cd_db->magic)) != 0 || cd_db->count > CD_DB_ENTRIES) {
+        memset(cd_db, 0, sizeof(struct cd_db));
+        memcpy(cd_db->magic, CD_DB_MAGIC, sizeof(cd_db->magic));
+    }
+    cd_db_unlock();
+    cd_db_failed = 0;
+    return cd_db;
+}
+
+static double cd_frecency(const struct cd_entry *entry, long long now) {
+    long long age = now - entry->last;
+
+    if (age < 3600) {
+        return entry->rank * 4;
+    }
+    if (age < 86400) {
+        return entry->rank * 2;
+    }
+    if (age < 604800) {
+        return entry->rank / 2;
+    }
+    return entry->rank / 4;
+}
+
+static void cd_db_remove(int index) {
+    cd_db->entries[index] = cd_db->entries[--cd_db->count];
+}
+
+// Function to note a visit to a directory
+void cd_db_record(const char *dir) {
+    long long now = time(NULL);
+    double total = 0;
+    int lowest = 0;
+
+    if (strlen(dir) >= CD_DB_PATH_MAX || cd_db_open() == NULL) {
+        return;
+    }
+
+    cd_db_lock();
+    for (unsigned int i = 0; i < cd_db->count; i++) {
+        struct cd_entry *entry = &cd_db->entries[i];
+        if (strcmp(entry->path, dir) == 0) {
+            entry->rank += 1;
+            entry->last = now;
+            cd_db_unlock();
+            return;
+        }
+        total += entry->rank;
+        if (cd_frecency(entry, now) < cd_frecency(&cd_db->entries[lowest], now)) {
+            lowest = i;
+        }
+    }
+
+    // Pruning is bounded: age everything once the ranks grow too large, and
+    // evict the least useful entry when the file is full
+    if (total > CD_DB_MAX_RANK) {
+        for (unsigned int i = 0; i < cd_db->count;) {
+            cd_db->entries[i].rank *= 0.99;
+            if (cd_db->entries[i].rank < 1) {
+                cd_db_remove(i);
+            } else {
+                i++;
+            }
+        }
+    }
+    if (cd_db->count == CD_DB_ENTRIES) {
+        cd_db_remove(lowest);
+    }
+
+    struct cd_entry *entry = &cd_db->entries[cd_db->count++];
+    entry->rank = 1;
+    entry->last = now;
+    strcpy(entry->path, dir);
+    cd_db_unlock();
+}
+
+// Function to score a path against a pattern; 0 means no match. The pattern
+// has to appear in order (case-insensitively) in the path, and matches that
+// sit in the last component or are contiguous rank higher.
+static int cd_match(const char *path, const char *pattern) {
+    const char *base = strrchr(path, '/');
+    const char *p = path;
+    const char *q = pattern;
+
+    base = base != NULL ? base + 1 : path;
+    if (strcasestr(base, pattern) != NULL) {
+        return 4;
+    }
+    if (strcasestr(path, pattern) != NULL) {
+        return 2;
+    }
+    while (*p != '\0' && *q != '\0') {
+        if (tolower((unsigned char)*p) == tolower((unsigned char)*q)) {
+            q++;
+        }
+        p++;
+    }
+    return *q == '\0' ? 1 : 0;
+}
+
+// Function to find the best match for a pattern, dropping entries for
+// directories that no longer exist as they are found. The path is copied out
+// of the mapping, which another shell may change once the lock is dropped.
+const char *cd_db_jump(const char *pattern) {
+    static char found[CD_DB_PATH_MAX];
+    long long now = time(NULL);
+
+    if (cd_db_open() == NULL) {
+        return NULL;
+    }
+
+    cd_db_lock();
+    while (1) {
+        int best = -1;
+        double best_score = 0;
+
+        for (unsigned int i = 0; i < cd_db->count; i++) {
+            struct cd_entry *entry = &cd_db->entries[i];
+            int match = cd_match(entry->path, pattern);
+            if (match == 0 || (shell_cwd != NULL && strcmp(entry->path, shell_cwd) == 0)) {
+                continue;
+            }
+            double score = match * cd_frecency(entry, now);
+            if (score > best_score) {
+                best = i;
+                best_score = score;
+            }
+        }
+        if (best == -1) {
+            cd_db_unlock();
+            return NULL;
+        }
+
+        struct stat st;
+        if (stat(cd_db->entries[best].path, &st) == 0 && S_ISDIR(st.st_mode)) {
+            strcpy(found, cd_db->entries[best].path);
+            cd_db_unlock();
+            return found;
+        }
+        cd_db_remove(best);
+    }
+}
+
+// Pipeline fan-out: 'producer |& { consumerA, consumerB }' sends the output of
+// one command to several others. The shell pumps the data itself with tee(2)
+// and splice(2), so the bytes are never copied through user space.
+
+// Function to pump everything from in_fd to each of the n out_fds. A consumer
+// that goes away is dropped; a slow one holds the producer back.
+static void fanout_pump(int in_fd, int *out_fds, int n) {
+#ifdef __linux__
+    int stage[n][2];
+    size_t pending[n];
+    int alive[n];
+    int nalive = 0;
+    int eof = 0;
+    long size = fcntl(in_fd, F_GETPIPE_SZ);
+
+    // Each consumer gets a staging pipe as large as the input one. tee(2) can
+    // only copy from the head of a pipe, so the next block is only taken once
+    // every staging pipe is empty and therefore has room for all of it.
+    for (int i = 0; i < n; i++) {
+        pending[i] = 0;
+        if (pipe2(stage[i], O_NONBLOCK | O_CLOEXEC) == -1) {
+            perror("pipe");
+            stage[i][0] = stage[i][1] = -1;
+            close(out_fds[i]);
+            out_fds[i] = -1;
+            continue;
+        }
+        if (size > 0) {
+            fcntl(stage[i][1], F_SETPIPE_SZ, size);
+        }
+        fcntl(out_fds[i], F_SETFL, O_NONBLOCK);
+    }
+    if (size <= 0) {
+        size = 65536;
+    }
+    // Resizing can fail past pipe-max-size, so take blocks no larger than
+    // the smallest staging pipe; every tee of a block then fits in full
+    for (int i = 0; i < n; i++) {
+        long stage_size = stage[i][1] >= 0 ? fcntl(stage[i][1], F_GETPIPE_SZ) : -1;
+        if (stage_size > 0 && stage_size < size) {
+            size = stage_size;
+        }
+    }
+
+    while (1) {
+        int busy = 0;
+
+        for (int i = 0; i < n; i++) {
+            if (out_fds[i] < 0 || pending[i] == 0) {
+                continue;
+            }
+            ssize_t moved = splice(stage[i][0], NULL, out_fds[i], NULL, pending[i], SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (moved > 0) {
+                pending[i] -= moved;
+            } else if (moved == -1 && errno != EAGAIN && errno != EINTR) {
+                // The consumer exited, stop feeding it
+                close(out_fds[i]);
+                out_fds[i] = -1;
+                pending[i] = 0;
+            }
+            if (pending[i] > 0) {
+                busy = 1;
+            }
+        }
+
+        if (busy) {
+            // Wait until one of the slow consumers can take more
+            struct pollfd pfds[n];
+            int npfds = 0;
+            for (int i = 0; i < n; i++) {
+                if (out_fds[i] >= 0 && pending[i] > 0) {
+                    pfds[npfds].fd = out_fds[i];
+                    pfds[npfds].events = POLLOUT;
+                    npfds++;
+                }
+            }
+            poll(pfds, npfds, -1);
+            continue;
+        }
+        if (eof) {
+            break;
+        }
+
+        nalive = 0;
+        for (int i = 0; i < n; i++) {
+            if (out_fds[i] >= 0) {
+                alive[nalive++] = i;
+            }
+        }
+        if (nalive == 0) {
+            break;
+        }
+
+        // Duplicate the next block into all but the last staging pipe, then
+        // move it into the last one, which also consumes it from the input
+        int last = alive[nalive - 1];
+        struct pollfd in_pfd = { .fd = in_fd, .events = POLLIN };
+        ssize_t got;
+
+        // The staging pipes are non-blocking, which makes tee(2) and splice(2)
+        // non-blocking too, so wait for the producer here
+        poll(&in_pfd, 1, -1);
+        if (nalive > 1) {
+            got = tee(in_fd, stage[alive[0]][1], size, 0);
+        } else {
+            got = splice(in_fd, NULL, stage[last][1], NULL, size, SPLICE_F_MOVE);
+        }
+        if (got == -1 && (errno == EINTR || errno == EAGAIN)) {
+            continue;
+        }
+        if (got <= 0) {
+            if (got == -1) {
+                perror("tee");
+            }
+            eof = 1;
+            continue;
+        }
+
+        for (int k = 0; k < nalive; k++) {
+            pending[alive[k]] = got;
+        }
+        for (int k = 1; k < nalive - 1; k++) {
+            int i = alive[k];
+            ssize_t copied;
+            do {
+                copied = tee(in_fd, stage[i][1], got, SPLICE_F_NONBLOCK);
+            } while (copied == -1 && errno == EINTR);
+            if (copied != got) {
+                // tee(2) only copies from the head of the input, so the
+                // missing part cannot be fetched once the block is moved on;
+                // drop the consumer rather than feed it a gap
+                fprintf(stderr, "fan-out: consumer %d could not keep up and was dropped\n", i + 1);
+                close(out_fds[i]);
+                out_fds[i] = -1;
+                copied = 0;
+            }
+            pending[i] = copied;
+        }
+        if (nalive > 1) {
+            ssize_t left = got;
+            while (left > 0) {
+                ssize_t moved = splice(in_fd, NULL, stage[last][1], NULL, left, SPLICE_F_MOVE);
+                if (moved <= 0 && errno != EINTR && errno != EAGAIN) {
+                    break;
+                }
+                if (moved > 0) {
+                    left -= moved;
+                }
+            }
+            pending[last] = got - left;
+        }
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (stage[i][0] >= 0) {
+            close(stage[i][0]);
+            close(stage[i][1]);
+        }
+    }
+#else
+    // Without tee(2) the data has to go through a buffer
+    char buf[65536];
+    ssize_t got;
+
+    while ((got = read(in_fd, buf, sizeof(buf))) != 0) {
+        if (got == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            ssize_t off = 0;
+            while (out_fds[i] >= 0 && off < got) {
+                ssize_t written = write(out_fds[i], buf + off, got - off);
+                if (written == -1 && errno != EINTR) {
+                    close(out_fds[i]);
+                    out_fds[i] = -1;
+                } else if (written > 0) {
+                    off += written;
+                }
+            }
+        }
+    }
+#endif
+    for (int i = 0; i < n; i++) {
+        if (out_fds[i] >= 0) {
+            close(out_fds[i]);
+        }
+    }
+}
+
+// Function to parse one side of a fan-out, which must be a simple command
+static command **fanout_parse(char *text) {
+    command **cmd_line = process_cmd_line(text, 1);
+
+    if (cmd_line[0]->com_name == NULL || cmd_line[1] != NULL) {
+        clean_up(cmd_line);
+        return NULL;
+    }
+    return cmd_line;
+}
+
+// Function to run a fan-out line. Returns 0 if the line is not one.
+int execute_fanout(char *line) {
+    char *op = strstr(line, "|&");
+    char *open_brace, *close_brace;
+    command **producer = NULL;
+    command **consumers[CMD_LENGTH];
+    int n = 0;
+    int ok = 1;
+
+    if (op == NULL) {
+        return 0;
+    }
+    var_sync_environ();
+    open_brace = op + 2 + strspn(op + 2, " \t");
+    close_brace = strrchr(open_brace, '}');
+    if (*open_brace != '{' || close_brace == NULL || close_brace[1 + strspn(close_brace + 1, " \t")] != '\0') {
+        fprintf(stderr, "fan-out: usage: producer |& { consumer, consumer... }\n");
+        set_last_status(2);
+        return 1;
+    }
+
+    *op = '\0';
+    *close_brace = '\0';
+    producer = fanout_parse(line);
+    ok = producer != NULL;
+    char *rest = open_brace + 1;
+    char *part;
+    while (ok && (part = strsep(&rest, ",")) != NULL && n < CMD_LENGTH) {
+        if ((consumers[n] = fanout_parse(part)) == NULL) {
+            ok = 0;
+            break;
+        }
+        n++;
+    }
+    if (!ok || n == 0) {
+        fprintf(stderr, "fan-out: each side must be a single simple command\n");
+        if (producer != NULL) {
+            clean_up(producer);
+        }
+        for (int i = 0; i < n; i++) {
+            clean_up(consumers[i]);
+        }
+        set_last_status(2);
+        return 1;
+    }
+
+    int in_pipe[2] = { -1, -1 };
+    int out_pipes[n][2];
+    int out_fds[n];
+    pid_t pids[n + 1];
+    int npids = 0;
+
+    if (pipe2(in_pipe, O_CLOEXEC) == -1) {
+        perror("pipe");
+        ok = 0;
+    }
+    for (int i = 0; ok && i < n; i++) {
+        if (pipe2(out_pipes[i], O_CLOEXEC) == -1) {
+            perror("pipe");
+            // Only the pipes made so far get closed below
+            n = i;
+            ok = 0;
+        }
+    }
+
+    sigset_t chld_mask, old_mask;
+    sigemptyset(&chld_mask);
+    sigaddset(&chld_mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld_mask, &old_mask);
+
+    // Every pipe is close-on-exec, so each child only keeps the end it
+    // dup2'ed onto its standard input or output
+    for (int i = -1; ok && i < n; i++) {
+        command *cmd = i < 0 ? producer[0] : consumers[i][0];
+        long long fork_ts = trace_now();
+
+        expand_wildcards(cmd, NULL);
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("fork");
+            // A partial fan-out would leave the others short of data, so
+            // stop the stages already started; they are reaped below
+            for (int k = 0; k < npids; k++) {
+                kill(pids[k], SIGTERM);
+            }
+            ok = 0;
+            break;
+        }
+        if (pid == 0) {
+            trace_child_reset();
+            record_child_reset();
+            sigprocmask(SIG_SETMASK, &old_mask, NULL);
+            if (i < 0) {
+                dup2(in_pipe[1], STDOUT_FILENO);
+            } else {
+                dup2(out_pipes[i][0], STDIN_FILENO);
+            }
+            exec_child(cmd, 0);
+        }
+        trace_event("fork", fork_ts, i + 1, getpid(), cmd->argv);
+        pids[npids++] = pid;
+    }
+
+    if (ok) {
+        close(in_pipe[1]);
+        for (int i = 0; i < n; i++) {
+            close(out_pipes[i][0]);
+            out_fds[i] = out_pipes[i][1];
+        }
+
+        // A consumer that exits early must not take the shell down with it
+        void (*old_sigpipe)(int) = signal(SIGPIPE, SIG_IGN);
+        fanout_pump(in_pipe[0], out_fds, n);
+        signal(SIGPIPE, old_sigpipe);
+        close(in_pipe[0]);
+    } else {
+        if (in_pipe[0] >= 0) {
+            close(in_pipe[0]);
+            close(in_pipe[1]);
+        }
+        for (int i = 0; i < n; i++) {
+            close(out_pipes[i][0]);
+            close(out_pipes[i][1]);
+        }
+    }
+
+    int status = -1;
+    for (int i = 0; i < npids; i++) {
+        status = wait_for_child(pids[i]);
+    }
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    set_last_status(ok ? decode_status(status) : 1);
+
+    clean_up(producer);
+    for (int i = 0; i < n; i++) {
+        clean_up(consumers[i]);
+    }
+    return 1;
+}
+
+// Process substitution. Each <(cmd) or >(cmd) on a line is started on a pipe
+// before the line is parsed, and replaced by the /dev/fd path of the pipe end
+// the command should open. The children are reaped once the line is done.
+#define MAX_PROCSUBS 64
+
+static int procsub_fds[MAX_PROCSUBS];
+static pid_t procsub_pids[MAX_PROCSUBS];
+static int procsub_count = 0;
+
+// Function to start one substitution; returns the fd to hand to the command
+static int procsub_start(const char *inner, int is_output) {
+    int fds[2];
+
+    if (procsub_count == MAX_PROCSUBS) {
+        fprintf(stderr, "too many process substitutions\n");
+        return -1;
+    }
+    if (pipe(fds) == -1) {
+        perror("pipe");
+        return -1;
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        trace_child_reset();
+        record_child_reset();
+        // Pipes of the other substitutions are not ours to keep open
+        for (int i = 0; i < procsub_count; i++) {
+            close(procsub_fds[i]);
+        }
+        procsub_count = 0;
+        if (is_output) {
+            dup2(fds[0], STDIN_FILENO);
+        } else {
+            dup2(fds[1], STDOUT_FILENO);
+        }
+        close(fds[0]);
+        close(fds[1]);
+
+        char *line = expand_process_substitutions((char *)inner);
+        execute_line(line);
+        procsub_finish(0);
+        exit(last_status);
+    }
+
+    // The shell keeps the end the command will use until the line is done
+    if (is_output) {
+        close(fds[0]);
+        procsub_fds[procsub_count] = fds[1];
+    } else {
+        close(fds[1]);
+        procsub_fds[procsub_count] = fds[0];
+    }
+    procsub_pids[procsub_count] = pid;
+    return procsub_fds[procsub_count++];
+}
+
+// Function to replace every <(cmd) and >(cmd) in a line; returns a new string
+char *expand_process_substitutions(char *line) {
+    size_t size = strlen(line) + 1;
+    char *result = malloc(size);
+    size_t len = 0;
+    char *p = line;
+
+    while (*p != '\0') {
+        if ((p[0] == '<' || p[0] == '>') && p[1] == '(') {
+            // Find the matching parenthesis, allowing nested ones
+            int depth = 1;
+            char *end = p + 2;
+            while (*end != '\0' && depth > 0) {
+                if (*end == '(') {
+                    depth++;
+                } else if (*end == ')') {
+                    depth--;
+                }
+                end++;
+            }
+            if (depth == 0) {
+                char *inner = strndup(p + 2, end - p - 3);
+                int fd = procsub_start(inner, p[0] == '>');
+                free(inner);
+                if (fd >= 0) {
+                    char path[32];
+                    int path_len = snprintf(path, sizeof(path), "/dev/fd/%d", fd);
+                    size += path_len;
+                    result = realloc(result, size);
+                    memcpy(result + len, path, path_len);
+                    len += path_len;
+                    p = end;
+                    continue;
+                }
+            }
+        }
+        result[len++] = *p++;
+    }
+    result[len] = '\0';
+    return result;
+}
+
+// Function to close the shell's pipe ends and reap the substitutions. For a
+// background line they are left to the SIGCHLD handler, which reaps them as
+// helper children once they exit, so the prompt does not wait for them.
+void procsub_finish(int background) {
+    for (int i = 0; i < procsub_count; i++) {
+        close(procsub_fds[i]);
+    }
+    // SIGCHLD may already have reaped some of them, which is fine
+    for (int i = 0; !background && i < procsub_count; i++) {
+        while (waitpid(procsub_pids[i], NULL, 0) == -1 && errno == EINTR) {
+        }
+    }
+    procsub_count = 0;
+}
+
+// Shell variables. All variables live in an open-addressed hash table, so a
+// lookup is one hash and a short probe instead of a scan of environ. The
+// environment handed to children is a cached array of the exported ones that
+// is only rebuilt after an exported variable changed.
+struct shell_var {
+    char *name;       // NULL for a free slot
+    char *value;      // NULL for a deleted slot
+    int exported;
+};
+
+extern char **environ;
+
+static struct shell_var *var_table = NULL;
+static size_t var_capacity = 0;
+static size_t var_used = 0;     // slots taken, deleted ones included
+static char **var_envp = NULL;
+static int var_envp_dirty = 1;
+
+static size_t var_hash(const char *name, size_t len) {
+    // FNV-1a
+    size_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Function to find the slot of a variable, or the slot it would go in
+static struct shell_var *var_find(const char *name, size_t len) {
+    size_t mask = var_capacity - 1;
+    size_t i = var_hash(name, len) & mask;
+    struct shell_var *tombstone = NULL;
+
+    while (var_table[i].name != NULL) {
+        if (var_table[i].value == NULL) {
+            if (tombstone == NULL) {
+                tombstone = &var_table[i];
+            }
+        } else if (strncmp(var_table[i].name, name, len) == 0 && var_table[i].name[len] == '\0') {
+            return &var_table[i];
+        }
+        i = (i + 1) & mask;
+    }
+    return tombstone != NULL ? tombstone : &var_table[i];
+}
+
+static void var_resize(size_t capacity) {
+    struct shell_var *old = var_table;
+    size_t old_capacity = var_capacity;
+
+    var_table = calloc(capacity, sizeof(struct shell_var));
+    if (var_table == NULL) {
+        perror("Unable to allocate memory for variables");
+        exit(EXIT_FAILURE);
+    }
+    var_capacity = capacity;
+    var_used = 0;
+
+    // Deleted slots are dropped on the way
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i].name == NULL) {
+            continue;
+        }
+        if (old[i].value == NULL) {
+            free(old[i].name);
+            continue;
+        }
+        struct shell_var *slot = var_find(old[i].name, strlen(old[i].name));
+        *slot = old[i];
+        var_used++;
+    }
+    free(old);
+}
+
+// Function to load the inherited environment into the variable table
+void var_init(void) {
+    size_t count = 0;
+
+    while (environ[count] != NULL) {
+        count++;
+    }
+    size_t capacity = 64;
+    while (capacity < count * 2) {
+        capacity *= 2;
+    }
+    var_resize(capacity);
+
+    for (size_t i = 0; i < count; i++) {
+        char *eq = strchr(environ[i], '=');
+        if (eq == NULL) {
+            continue;
+        }
+        *eq = '\0';
+        var_set(environ[i], eq + 1, 1);
+        *eq = '=';
+    }
+    var_sync_environ();
+}
+
+const char *var_get(const char *name) {
+    struct shell_var *var = var_find(name, strlen(name));
+    return var->name != NULL ? var->value : NULL;
+}
+
+// Function to set a variable. export is 1 to export it, 0 to make it local
+// and -1 to leave that as it was (new variables are local).
+void var_set(const char *name, const char *value, int export) {
+    size_t len = strlen(name);
+    struct shell_var *var = var_find(name, len);
+    // value may be the variable's own current value
+    char *copy = strdup(value);
+
+    if (var->name == NULL || var->value == NULL) {
+        // Keep the table at most 3/4 full, counting deleted slots
+        if ((var_used + 1) * 4 > var_capacity * 3) {
+            var_resize(var_capacity * 2);
+            var = var_find(name, len);
+        }
+        if (var->name == NULL) {
+            var_used++;
+        } else {
+            free(var->name);
+        }
+        var->name = strdup(name);
+        var->exported = 0;
+    } else {
+        if (strcmp(var->value, value) == 0 && (export == -1 || export == var->exported)) {
+            free(copy);
+            return;
+        }
+        free(var->value);
+        if (var->exported) {
+            var_envp_dirty = 1;
+        }
+    }
+    var->value = copy;
+    if (export != -1) {
+        var->exported = export;
+    }
+    if (var->exported) {
+        var_envp_dirty = 1;
+    }
+}
+
+void var_unset(const char *name) {
+    struct shell_var *var = var_find(name, strlen(name));
+
+    if (var->name == NULL || var->value == NULL) {
+        return;
+    }
+    if (var->exported) {
+        var_envp_dirty = 1;
+    }
+    // Leave the name behind as a tombstone so probing still works
+    free(var->value);
+    var->value = NULL;
+    var->exported = 0;
+}
+
+// Function to rebuild the exported environment if it changed, and make it
+// the one every child inherits and execvp searches PATH in
+void var_sync_environ(void) {
+    size_t count = 0;
+
+    if (!var_envp_dirty) {
+        return;
+    }
+    if (var_envp != NULL) {
+        for (size_t i = 0; var_envp[i] != NULL; i++) {
+            free(var_envp[i]);
+        }
+        free(var_envp);
+    }
+
+    for (size_t i = 0; i < var_capacity; i++) {
+        if (var_table[i].name != NULL && var_table[i].value != NULL && var_table[i].exported) {
+            count++;
+        }
+    }
+    var_envp = malloc((count + 1) * sizeof(char *));
+    if (var_envp == NULL) {
+        perror("Unable to allocate memory for the environment");
+        exit(EXIT_FAILURE);
+    }
+    count = 0;
+    for (size_t i = 0; i < var_capacity; i++) {
+        struct shell_var *var = &var_table[i];
+        if (var->name != NULL && var->value != NULL && var->exported) {
+            var_envp[count] = malloc(strlen(var->name) + strlen(var->value) + 2);
+            sprintf(var_envp[count], "%s=%s", var->name, var->value);
+            count++;
+        }
+    }
+    var_envp[count] = NULL;
+    environ = var_envp;
+    var_envp_dirty = 0;
+}
+
+// Function to check for a NAME=value word
+// Function to skip a variable name, [A-Za-z_][A-Za-z0-9_]*; returns the
+// first character after it, or the word itself if it does not start with one
+static const char *skip_name(const char *word) {
+    if (!(isalpha((unsigned char)*word) || *word == '_')) {
+        return word;
+    }
+    while (isalnum((unsigned char)*word) || *word == '_') {
+        word++;
+    }
+    return word;
+}
+
+int is_valid_name(const char *word) {
+    const char *end = skip_name(word);
+    return end != word && *end == '\0';
+}
+
+int is_assignment(const char *word) {
+    if (word == NULL) {
+        return 0;
+    }
+    const char *end = skip_name(word);
+    return end != word && *end == '=';
+}
+
+int only_assignments(char **argv) {
+    for (int i = 0; argv[i] != NULL; i++) {
+        if (!is_assignment(argv[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Built-in 'export' command implementation
+void builtin_export(char **argv) {
+    if (argv[1] == NULL) {
+        for (size_t i = 0; i < var_capacity; i++) {
+            struct shell_var *var = &var_table[i];
+            if (var->name != NULL && var->value != NULL && var->exported) {
+                printf("export %s=%s\n", var->name, var->value);
+            }
+        }
+        set_last_status(0);
+        return;
+    }
+
+    for (int i = 1; argv[i] != NULL; i++) {
+        char *eq = strchr(argv[i], '=');
+        if (eq != NULL && is_assignment(argv[i])) {
+            *eq = '\0';
+            var_set(argv[i], eq + 1, 1);
+            *eq = '=';
+        } else if (eq == NULL && is_valid_name(argv[i])) {
+            // Exporting a name without a value keeps the current one
+            const char *value = var_get(argv[i]);
+            var_set(argv[i], value != NULL ? value : "", 1);
+        } else {
+            fprintf(stderr, "export: %s: not a valid identifier\n", argv[i]);
+            set_last_status(1);
+            return;
+        }
+    }
+    set_last_status(0);
+}
+
+// Built-in 'unset' command implementation
+void builtin_unset(char **argv) {
+    int status = 0;
+
+    for (int i = 1; argv[i] != NULL; i++) {
+        if (!is_valid_name(argv[i])) {
+            fprintf(stderr, "unset: %s: not a valid identifier\n", argv[i]);
+            status = 1;
+            continue;
+        }
+        var_unset(argv[i]);
+    }
+    set_last_status(status);
+}
+
+// Session recording. Every input line is appended to the record file as one
+// tab-separated line: wall clock start and duration in microseconds, exit
+// status, working directory the line started in and the line as typed, with tabs, newlines and
+// backslashes escaped. bench/replay feeds such files back to the shell.
+#define RECORD_HEADER "#shell-record 1\n"
+
+void record_open(const char *path) {
+    struct stat st;
+
+    record_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (record_fd < 0) {
+        perror("record");
+        return;
+    }
+    if (fstat(record_fd, &st) == 0 && st.st_size == 0) {
+        if (write(record_fd, RECORD_HEADER, strlen(RECORD_HEADER)) < 0) {
+            perror("record");
+        }
+    }
+}
+
+void record_close(void) {
+    if (record_fd < 0) {
+        return;
+    }
+    record_end();
+    close(record_fd);
+    record_fd = -1;
+}
+
+// A forked child must not write the record of the line the shell is running
+// when it exits, or the line would be logged twice
+void record_child_reset(void) {
+    record_fd = -1;
+    free(record_line);
+    record_line = NULL;
+}
+
+static long long record_clock(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Function to note the start of an input line
+void record_begin(const char *line) {
+    if (record_fd < 0) {
+        return;
+    }
+    free(record_line);
+    free(record_cwd);
+    record_line = strdup(line);
+    record_cwd = strdup(shell_cwd != NULL ? shell_cwd : "");
+    record_wall = record_clock(CLOCK_REALTIME);
+    record_start = record_clock(CLOCK_MONOTONIC);
+}
+
+// Function to write the record of the line begun last, if there is one
+void record_end(void) {
+    if (record_fd < 0 || record_line == NULL) {
+        return;
+    }
+    long long duration = record_clock(CLOCK_MONOTONIC) - record_start;
+    size_t size = strlen(record_cwd) + 2 * strlen(record_line) + 80;
+    char *out = malloc(size);
+    int len = snprintf(out, size, "%lld\t%lld\t%d\t%s\t", record_wall, duration, last_status, record_cwd);
+
+    for (const char *p = record_line; *p != '\0'; p++) {
+        switch (*p) {
+            case '\t': out[len++] = '\\'; out[len++] = 't'; break;
+            case '\n': out[len++] = '\\'; out[len++] = 'n'; break;
+            case '\\': out[len++] = '\\'; out[len++] = '\\'; break;
+            default: out[len++] = *p; break;
+        }
+    }
+    out[len++] = '\n';
+
+    // One write per record keeps concurrent shells from interleaving lines
+    if (write(record_fd, out, len) < 0) {
+        perror("record");
+    }
+    free(out);
+    free(record_line);
+    record_line = NULL;
+}
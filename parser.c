@@ -15,6 +15,311 @@
 
 // #define DEBUG
 
+/*
+ * Metacharacter scanning.
+ *
+ * Rather than searching the line again for every separator, redirection and
+ * argument, the parser classifies the whole line once into three bitmaps (one
+ * bit per byte) and the tokenizer jumps between the set bits. The
+ * classification runs 64 bytes at a time, with SSE2 or AVX2 compares where
+ * the CPU has them; the kernel is picked on first use.
+ */
+
+typedef void (*scan_kernel)(const unsigned char *str, size_t blocks,
+                            unsigned long long *sep, unsigned long long *redir,
+                            unsigned long long *space);
+
+#define SCAN_SEP   1
+#define SCAN_REDIR 2
+#define SCAN_SPACE 4
+
+static const unsigned char scan_class[256] = {
+   ['&'] = SCAN_SEP, ['|'] = SCAN_SEP, [';'] = SCAN_SEP,
+   ['<'] = SCAN_REDIR, ['>'] = SCAN_REDIR,
+   [' '] = SCAN_SPACE, ['\t'] = SCAN_SPACE,
+};
+
+static void scan_blocks_scalar(const unsigned char *str, size_t blocks,
+                               unsigned long long *sep, unsigned long long *redir,
+                               unsigned long long *space)
+{
+   size_t b;
+   int i;
+
+   for (b = 0; b < blocks; b++, str += 64)
+   {
+      unsigned long long s = 0, r = 0, w = 0;
+
+      for (i = 0; i < 64; i++)
+      {
+         unsigned long long c = scan_class[str[i]];
+         s |= (c & 1) << i;
+         r |= ((c >> 1) & 1) << i;
+         w |= ((c >> 2) & 1) << i;
+      }
+      sep[b] = s;
+      redir[b] = r;
+      space[b] = w;
+   }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("sse2")))
+static void scan_blocks_sse2(const unsigned char *str, size_t blocks,
+                             unsigned long long *sep, unsigned long long *redir,
+                             unsigned long long *space)
+{
+   const __m128i amp = _mm_set1_epi8('&'), bar = _mm_set1_epi8('|');
+   const __m128i semi = _mm_set1_epi8(';'), lt = _mm_set1_epi8('<');
+   const __m128i gt = _mm_set1_epi8('>'), sp = _mm_set1_epi8(' ');
+   const __m128i tab = _mm_set1_epi8('\t');
+   size_t b;
+   int i;
+
+   for (b = 0; b < blocks; b++, str += 64)
+   {
+      unsigned long long s = 0, r = 0, w = 0;
+
+      for (i = 0; i < 4; i++)
+      {
+         __m128i v = _mm_loadu_si128((const __m128i *) (str + 16 * i));
+         __m128i vs = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, amp), _mm_cmpeq_epi8(v, bar)),
+                                   _mm_cmpeq_epi8(v, semi));
+         __m128i vr = _mm_or_si128(_mm_cmpeq_epi8(v, lt), _mm_cmpeq_epi8(v, gt));
+         __m128i vw = _mm_or_si128(_mm_cmpeq_epi8(v, sp), _mm_cmpeq_epi8(v, tab));
+
+         s |= (unsigned long long) (unsigned) _mm_movemask_epi8(vs) << (16 * i);
+         r |= (unsigned long long) (unsigned) _mm_movemask_epi8(vr) << (16 * i);
+         w |= (unsigned long long) (unsigned) _mm_movemask_epi8(vw) << (16 * i);
+      }
+      sep[b] = s;
+      redir[b] = r;
+      space[b] = w;
+   }
+}
+
+__attribute__((target("avx2")))
+static void scan_blocks_avx2(const unsigned char *str, size_t blocks,
+                             unsigned long long *sep, unsigned long long *redir,
+                             unsigned long long *space)
+{
+   const __m256i amp = _mm256_set1_epi8('&'), bar = _mm256_set1_epi8('|');
+   const __m256i semi = _mm256_set1_epi8(';'), lt = _mm256_set1_epi8('<');
+   const __m256i gt = _mm256_set1_epi8('>'), sp = _mm256_set1_epi8(' ');
+   const __m256i tab = _mm256_set1_epi8('\t');
+   size_t b;
+   int i;
+
+   for (b = 0; b < blocks; b++, str += 64)
+   {
+      unsigned long long s = 0, r = 0, w = 0;
+
+      for (i = 0; i < 2; i++)
+      {
+         __m256i v = _mm256_loadu_si256((const __m256i *) (str + 32 * i));
+         __m256i vs = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, amp), _mm256_cmpeq_epi8(v, bar)),
+                                      _mm256_cmpeq_epi8(v, semi));
+         __m256i vr = _mm256_or_si256(_mm256_cmpeq_epi8(v, lt), _mm256_cmpeq_epi8(v, gt));
+         __m256i vw = _mm256_or_si256(_mm256_cmpeq_epi8(v, sp), _mm256_cmpeq_epi8(v, tab));
+
+         s |= (unsigned long long) (unsigned) _mm256_movemask_epi8(vs) << (32 * i);
+         r |= (unsigned long long) (unsigned) _mm256_movemask_epi8(vr) << (32 * i);
+         w |= (unsigned long long) (unsigned) _mm256_movemask_epi8(vw) << (32 * i);
+      }
+      sep[b] = s;
+      redir[b] = r;
+      space[b] = w;
+   }
+}
+#endif
+
+static scan_kernel scan_active = NULL;
+static const char *scan_active_name = NULL;
+
+/*Index of the line process_cmd_line() is working on, if any.*/
+static const scan_index *scan_line = NULL;
+static const char *scan_line_start = NULL;
+
+/*
+ * This function selects the classification kernel. It is called with NULL on
+ * first use to pick the widest one the CPU supports, and by benchmarks to
+ * force a particular one.
+ *
+ * Arguments :
+ *      name - "scalar", "sse2", "avx2", or NULL for the best available.
+ *
+ * Returns :
+ *      The name of the kernel now in use, or NULL if the requested one is
+ *      not supported (the current kernel is then kept).
+ *
+ */
+const char *scan_use_kernel(const char *name)
+{
+   scan_kernel kernel = scan_blocks_scalar;
+   const char *kernel_name = "scalar";
+
+#if defined(__x86_64__) || defined(__i386__)
+   __builtin_cpu_init();
+   if ((name == NULL || strcmp(name, "avx2") == 0) && __builtin_cpu_supports("avx2"))
+   {
+      kernel = scan_blocks_avx2;
+      kernel_name = "avx2";
+   }
+   else if ((name == NULL || strcmp(name, "sse2") == 0) && __builtin_cpu_supports("sse2"))
+   {
+      kernel = scan_blocks_sse2;
+      kernel_name = "sse2";
+   }
+#endif
+   if (name != NULL && strcmp(name, kernel_name) != 0)
+      return NULL;
+
+   scan_active = kernel;
+   scan_active_name = kernel_name;
+   return scan_active_name;
+}
+
+/*
+ * This function classifies every byte of a string in one sweep, recording the
+ * positions of separators, redirections and white space.
+ *
+ * Arguments :
+ *      str - the string to be scanned.
+ *      len - its length.
+ *      idx - the index to fill in; release it with scan_free().
+ *
+ * Returns :
+ *      None.
+ *
+ */
+void scan_build(const char *str, size_t len, scan_index *idx)
+{
+   size_t words = (len + 63) / 64;
+   size_t full = len / 64;
+
+   if (scan_active == NULL)
+      scan_use_kernel(NULL);
+
+   if (words <= SCAN_INLINE_BYTES / 64)
+   {
+      idx->sep = idx->inline_bits;
+      words = SCAN_INLINE_BYTES / 64;
+   }
+   else if ((idx->sep = malloc(3 * words * sizeof(unsigned long long))) == NULL)
+   {
+      perror("Unable to allocate memory for the line scan");
+      exit(EXIT_FAILURE);
+   }
+   idx->redir = idx->sep + words;
+   idx->space = idx->redir + words;
+   idx->len = len;
+
+   scan_active((const unsigned char *) str, full, idx->sep, idx->redir, idx->space);
+
+   /*The tail is classified from a zero padded copy; padding sets no bits. */
+   if (len % 64 != 0)
+   {
+      unsigned char tail[64] = { 0 };
+
+      memcpy(tail, str + 64 * full, len % 64);
+      scan_active(tail, 1, idx->sep + full, idx->redir + full, idx->space + full);
+   }
+}
+
+/*
+ * These functions find the first set (or clear) bit at or after pos.
+ *
+ * Returns :
+ *      Its position, or len if there is none.
+ *
+ */
+size_t scan_next(const unsigned long long *bits, size_t len, size_t pos)
+{
+   size_t words = (len + 63) / 64;
+   size_t w = pos / 64;
+   unsigned long long word;
+
+   if (pos >= len)
+      return len;
+   word = bits[w] & (~0ULL << (pos % 64));
+   while (word == 0)
+   {
+      if (++w == words)
+         return len;
+      word = bits[w];
+   }
+   pos = 64 * w + __builtin_ctzll(word);
+   return pos < len ? pos : len;
+}
+
+size_t scan_next_clear(const unsigned long long *bits, size_t len, size_t pos)
+{
+   size_t words = (len + 63) / 64;
+   size_t w = pos / 64;
+   unsigned long long word;
+
+   if (pos >= len)
+      return len;
+   word = ~bits[w] & (~0ULL << (pos % 64));
+   while (word == 0)
+   {
+      if (++w == words)
+         return len;
+      word = ~bits[w];
+   }
+   pos = 64 * w + __builtin_ctzll(word);
+   return pos < len ? pos : len;
+}
+
+void scan_free(scan_index *idx)
+{
+   if (idx->sep != idx->inline_bits)
+      free(idx->sep);
+   idx->sep = NULL;
+}
+
+/*
+ * The functions below let process_cmd() and process_simple_cmd() work on the
+ * index of the whole line when their string is part of it, and scan the
+ * string themselves otherwise. Positions are relative to the string; base is
+ * its offset into the index.
+ */
+static const scan_index *scan_lookup(const char *cmd, size_t len,
+                                     scan_index *local, size_t *base)
+{
+   local->sep = local->inline_bits;
+   if (scan_line != NULL && cmd >= scan_line_start
+       && cmd + len <= scan_line_start + scan_line->len)
+   {
+      *base = cmd - scan_line_start;
+      return scan_line;
+   }
+   scan_build(cmd, len, local);
+   *base = 0;
+   return local;
+}
+
+static size_t scan_from(const unsigned long long *bits, size_t base, size_t len, size_t pos)
+{
+   return scan_next(bits, base + len, base + pos) - base;
+}
+
+static size_t scan_clear_from(const unsigned long long *bits, size_t base, size_t len, size_t pos)
+{
+   return scan_next_clear(bits, base + len, base + pos) - base;
+}
+
+static size_t scan_find(const char *cmd, const scan_index *idx, size_t base,
+                        size_t len, char c, size_t pos)
+{
+   pos = scan_from(idx->redir, base, len, pos);
+   while (pos < len && cmd[pos] != c)
+      pos = scan_from(idx->redir, base, len, pos + 1);
+   return pos;
+}
+
 /*
  * This function breakes the simple command token isolated in other functions
  * into a sequence of arguments. Each argument is bounded by white-spaces, and
@@ -30,51 +335,48 @@
  *
  */
 void process_simple_cmd(char *cmd, command * result) {
-   char *dc;
-   int lpc = 1;
+   scan_index local;
+   const scan_index *idx;
+   size_t len = strlen(cmd);
+   size_t base, start, end;
+   int lpc = 0;
 #ifdef DEBUG
    fprintf(stderr,"process_simple_cmd\n");
 #endif
+   idx = scan_lookup(cmd, len, &local, &base);
+
    /*No Spaces Means No Arguments. */
-   if (((dc = index(cmd, white_space[0])) == NULL
-        && (dc = index(cmd, white_space[1])) == NULL)
-       && (dc = index(cmd, (char) 9)) == NULL) {
+   if (scan_from(idx->space, base, len, 0) == len) {
       result->com_name = strdup(cmd);
       result->argv = realloc((void *) result->argv, sizeof(char *));
       result->argv[0] = strdup(cmd);
+      lpc = 1;
    }
    else {
-
-      // nick modified this
-      /*Pull out the Command Name (i.e First Token) */
-      dc = strtok(cmd, white_space);
-      //dc = cmd;
-#ifdef DEBUG
-      fprintf(stderr,"[%s][%s]\n",dc,cmd);
-#endif
-      result->com_name = strdup(dc);
-      //result->com_name = strdup(cmd);
-      // end nick
+      /*Jump from the start of each token to the white space ending it. */
+      start = scan_clear_from(idx->space, base, len, 0);
+      while (start < len) {
+         end = scan_from(idx->space, base, len, start);
+         cmd[end] = '\0';
 #ifdef DEBUG
-      fprintf(stderr,"{1}\n");	
-#endif
-      result->argv = realloc((void *) result->argv, sizeof(char *));
-#ifdef DEBUG
-      fprintf(stderr,"{2}\n");	
-#endif
-      result->argv[0] = strdup(dc);
-
-
-      /*Loop through the remaining tokens, writing them to the struct. */
-      while ((dc = strtok(NULL, white_space)) != NULL) {
-#ifdef DEBUG
-	 fprintf(stderr,"[%s]\n",dc);
+         fprintf(stderr,"[%s]\n",cmd + start);
 #endif
          result->argv = realloc((void *) result->argv, (lpc + 1) * sizeof(char *));
-         result->argv[lpc] = strdup(dc);
+         result->argv[lpc] = strdup(cmd + start);
          lpc++;
+         start = scan_clear_from(idx->space, base, len, end);
+      }
+
+      /*Nothing but white space is an empty command. */
+      if (lpc == 0) {
+         result->argv = realloc((void *) result->argv, sizeof(char *));
+         result->argv[0] = strdup("");
+         lpc = 1;
       }
+      result->com_name = strdup(result->argv[0]);
    }
+   scan_free(&local);
+
    /*Set the final array element NULL. */
    result->argv = realloc((void *) result->argv, (lpc + 1) * sizeof(char *));
    result->argv[lpc] = NULL;
@@ -116,23 +418,41 @@ void trim_whitespace(char *str) {
  *
  */
 void process_cmd(char *cmd, command *result) {
-    char *pc, *mc, *ec;
+    char *pc, *ec;
     char *simple_cmd = NULL;
+    scan_index local;
+    const scan_index *idx;
+    size_t len = strlen(cmd);
+    size_t base, in, out, out_after, err;
 
     result->redirect_in = NULL;
     result->redirect_out = NULL;
     result->redirect_err = NULL;
 
+    // Find the redirections from the scan instead of searching the string
+    idx = scan_lookup(cmd, len, &local, &base);
+    err = scan_from(idx->redir, base, len, 0);
+    while (err < len && (cmd[err] != '>' || err == 0 || cmd[err - 1] != '2')) {
+        err = scan_from(idx->redir, base, len, err + 1);
+    }
+
     // Check for standard error redirection
-    if ((ec = strstr(cmd, "2>")) != NULL) {
+    if (err < len) {
+        ec = cmd + err - 1;
         *ec = '\0';
         ec += 2;
+        len = err - 1;
         result->redirect_err = strdup(strtok(ec, " \t\n"));
         trim_whitespace(result->redirect_err);
     }
 
-    if ((pc = index(cmd, '<')) == NULL) {
-        if ((pc = index(cmd, '>')) == NULL) {
+    in = scan_find(cmd, idx, base, len, '<', 0);
+    out = scan_find(cmd, idx, base, len, '>', 0);
+    out_after = in < len ? scan_find(cmd, idx, base, len, '>', in + 1) : len;
+    scan_free(&local);
+
+    if (in == len) {
+        if (out == len) {
             process_simple_cmd(cmd, result);
             result->redirect_in = NULL;
             result->redirect_out = NULL;
@@ -149,9 +469,11 @@ void process_cmd(char *cmd, command *result) {
         simple_cmd = strdup(pc);
         pc = strtok(NULL, "\0");
 
-        if ((mc = index(simple_cmd, '>')) != NULL)
+        // strtok() skips a leading '<', so then the pieces no longer line
+        // up with the scan and are searched directly
+        if (in > 0 ? out < in : index(simple_cmd, '>') != NULL)
             process_cmd(simple_cmd, result);
-        if ((mc = index(pc, '>')) != NULL)
+        if (in > 0 ? out_after < len : index(pc, '>') != NULL)
             process_cmd(pc, result);
 
         process_simple_cmd(simple_cmd, result);
@@ -191,8 +513,20 @@ command **process_cmd_line(char *cmd, int new)
       cmd_line = NULL;
    }
 
+   // Classify the whole line once; the commands split from it below reuse
+   // the scan instead of searching their part of the line again
+   scan_index idx;
+   char *line = cmd;
+   size_t len = strlen(cmd);
+   size_t pos;
+
+   scan_build(line, len, &idx);
+   scan_line = &idx;
+   scan_line_start = line;
+
    // Split the command line at '&' and '|' to handle background execution and piping
-   char *next_cmd = strpbrk(cmd, "&|;");
+   pos = scan_next(idx.sep, len, 0);
+   char *next_cmd = pos < len ? line + pos : NULL;
    while (next_cmd != NULL)
    {
       int is_background = *next_cmd == '&';
@@ -231,8 +565,9 @@ command **process_cmd_line(char *cmd, int new)
       }
 
       lc++;
-      cmd = next_cmd;                 // Process the next command
-      next_cmd = strpbrk(cmd, "&|;"); // Find the next delimiter
+      cmd = next_cmd;                          // Process the next command
+      pos = scan_next(idx.sep, len, pos + 1);  // Jump to the next delimiter
+      next_cmd = pos < len ? line + pos : NULL;
    }
 
    // Process the last or only command
@@ -253,6 +588,10 @@ command **process_cmd_line(char *cmd, int new)
    process_cmd(cmd, cmd_line[lc]);
    lc++;
 
+   scan_line = NULL;
+   scan_line_start = NULL;
+   scan_free(&idx);
+
    // Terminate the command array
    cmd_line = realloc(cmd_line, (lc + 1) * sizeof(command *));
    cmd_line[lc] = NULL;
@@ -21,6 +21,24 @@
 static const char white_space[3] = { (char) 0x20, (char) 0x09, (char) 0x00 };
 
 
+/*Lines up to this many bytes are scanned without allocating.*/
+#define SCAN_INLINE_BYTES 512
+
+/*
+ * Positions of the characters the parser splits on, one bit per byte of the
+ * line: command separators (& | ;), redirections (< >) and white space.
+ */
+typedef struct Scan_struct
+{
+   unsigned long long *sep;
+   unsigned long long *redir;
+   unsigned long long *space;
+   size_t len;
+   unsigned long long inline_bits[3 * (SCAN_INLINE_BYTES / 64)];
+}
+scan_index;
+
+
 /*The Structure we create for the commands.*/
 typedef struct Command_struct
 {
@@ -44,4 +62,11 @@ void clean_up(command ** cmd);
 void clean_up(command ** cmd);
 void trim_whitespace(char *str);
 
+/* Metacharacter scanning */
+void scan_build(const char *str, size_t len, scan_index *idx);
+size_t scan_next(const unsigned long long *bits, size_t len, size_t pos);
+size_t scan_next_clear(const unsigned long long *bits, size_t len, size_t pos);
+void scan_free(scan_index *idx);
+const char *scan_use_kernel(const char *name);
+
 #endif